@@ -57,7 +57,9 @@ void Bitmap::resize(size_t w, size_t h) {
     size_t extra = numBits & 31 ? 1 : 0;
     size = (numBits >> 5) + extra;
     bits = std::make_unique<uint32_t[]>(size);
-    bits[size-1] &= allOnes >> (32 - (numBits & 31));
+    if (numBits & 31) {
+        bits[size-1] &= allOnes >> (32 - (numBits & 31));
+    }
 }
 
 
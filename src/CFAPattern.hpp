@@ -54,11 +54,6 @@ public:
         }
     }
     
-    bool canAlign() const  {
-        uint8_t * f = (uint8_t *)&filters;
-        return f[0] == f[1] && f[0] == f[2] && f[0] == f[3];
-    }
-
     uint32_t getFilters() const { return filters; }
 
     int getRows() const {
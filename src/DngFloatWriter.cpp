@@ -20,10 +20,13 @@
  *
  */
 
+#include <atomic>
 #include <iostream>
 #include <cmath>
 #include <QBuffer>
+#include <QCryptographicHash>
 #include <QDateTime>
+#include <QtEndian>
 #include <QImageWriter>
 #include <zlib.h>
 #ifdef __SSE2__
@@ -82,6 +85,8 @@ enum {
     CAMERANEUTRAL = 50728,
     ORIENTATION = 274,
     UNIQUENAME = 50708,
+    RAWDATAUNIQUEID = 50781,
+    NEWRAWIMAGEDIGEST = 51111,
     SUBIFDS = 330,
 
     TIFFEPSTD = 37398,
@@ -117,11 +122,11 @@ enum {
 };
 
 
-void DngFloatWriter::write(Array2D<float> && rawPixels, const RawParameters & p, const QString & dstFileName) {
+void DngFloatWriter::write(const Array2D<float> & rawPixels, const RawParameters & p, const QString & dstFileName) {
     params = &p;
-    rawData = std::move(rawPixels);
-    width = rawData.getWidth();
-    height = rawData.getHeight();
+    rawData = &rawPixels;
+    width = rawData->getWidth();
+    height = rawData->getHeight();
 
     renderPreviews();
 
@@ -151,7 +156,11 @@ void DngFloatWriter::write(Array2D<float> && rawPixels, const RawParameters & p,
         previewIFD.write(fileData.get(), pos, false);
     }
 
-    Exif::transfer(p.fileName, dstFileName, fileData.get(), dataSize);
+    if (exifSource) {
+        Exif::transfer(*exifSource, dstFileName, fileData.get(), dataSize);
+    } else {
+        Exif::transfer(p.fileName, dstFileName, fileData.get(), dataSize);
+    }
 }
 
 
@@ -200,7 +209,10 @@ void DngFloatWriter::createMainIFD() {
     mainIFD.addEntry(CAMERANEUTRAL, IFD::RATIONAL, params->colors, cameraNeutral);
     mainIFD.addEntry(ORIENTATION, IFD::SHORT, params->tiffOrientation);
     mainIFD.addEntry(UNIQUENAME, params->maker + " " + params->model);
-    // TODO: Add Digest and Unique ID
+    // Filled in by writeRawData
+    uint8_t digest[16] = {};
+    mainIFD.addEntry(NEWRAWIMAGEDIGEST, IFD::BYTE, 16, digest);
+    mainIFD.addEntry(RAWDATAUNIQUEID, IFD::BYTE, 16, digest);
     mainIFD.addEntry(SUBIFDS, IFD::LONG, previewWidth > 0 ? 2 : 1, subIFDoffsets);
 
     // Thumbnail
@@ -314,9 +326,11 @@ void DngFloatWriter::createPreviewIFD() {
     previewIFD.addEntry(PLANARCONFIG, IFD::SHORT, 1);
     previewIFD.addEntry(PHOTOINTERPRETATION, IFD::SHORT, TIFF_YCBCR);
     previewIFD.addEntry(COMPRESSION, IFD::SHORT, TIFF_JPEG);
-    previewIFD.addEntry(ROWSPERSTRIP, IFD::LONG, preview.height());
-    previewIFD.addEntry(STRIPBYTES, IFD::LONG, 0);
-    previewIFD.addEntry(STRIPOFFSETS, IFD::LONG, 0);
+    previewIFD.addEntry(ROWSPERSTRIP, IFD::LONG, previewStripRows);
+    // Filled in by writePreviews
+    std::vector<uint32_t> strips(jpegPreviewStrips.size());
+    previewIFD.addEntry(STRIPBYTES, IFD::LONG, strips.size(), strips.data());
+    previewIFD.addEntry(STRIPOFFSETS, IFD::LONG, strips.size(), strips.data());
     uint16_t subsampling[] = { 2, 2 };
     previewIFD.addEntry(YCBCRSUBSAMPLING, IFD::SHORT, 2, subsampling);
     previewIFD.addEntry(YCBCRPOSITIONING, IFD::SHORT, 2);
@@ -329,12 +343,26 @@ void DngFloatWriter::createPreviewIFD() {
 
 void DngFloatWriter::renderPreviews() {
     if (previewWidth > 0) {
-        QBuffer buffer(&jpegPreviewData);
-        buffer.open(QIODevice::WriteOnly);
-        QImageWriter writer(&buffer, "JPG");
-        writer.setQuality(85);
-        if (!writer.write(preview)) {
-            std::cerr << "Error converting the preview to JPEG: " << writer.errorString() << std::endl;
+        Timer t("Encode preview");
+        // Strips of a multiple of 16 rows are encoded as independent JPEG streams, in parallel
+        int numStrips = (preview.height() + previewStripRows - 1) / previewStripRows;
+        jpegPreviewStrips.assign(numStrips, QByteArray());
+        std::atomic<bool> failed(false);
+        #pragma omp parallel for schedule(dynamic)
+        for (int s = 0; s < numStrips; ++s) {
+            int rows = std::min(previewStripRows, preview.height() - s * previewStripRows);
+            QBuffer buffer(&jpegPreviewStrips[s]);
+            buffer.open(QIODevice::WriteOnly);
+            QImageWriter writer(&buffer, "JPG");
+            writer.setQuality(85);
+            if (!writer.write(preview.copy(0, s * previewStripRows, preview.width(), rows))) {
+                #pragma omp critical
+                std::cerr << "Error converting the preview to JPEG: " << writer.errorString() << std::endl;
+                failed = true;
+            }
+        }
+        if (failed) {
+            jpegPreviewStrips.clear();
             previewWidth = 0;
         }
     }
@@ -357,7 +385,11 @@ size_t DngFloatWriter::thumbSize() {
 
 
 size_t DngFloatWriter::previewSize() {
-    return previewWidth > 0 ? jpegPreviewData.size() : 0;
+    size_t size = 0;
+    for (const QByteArray & strip : jpegPreviewStrips) {
+        size += strip.size();
+    }
+    return previewWidth > 0 ? size : 0;
 }
 
 
@@ -367,10 +399,14 @@ void DngFloatWriter::writePreviews() {
     mainIFD.setValue(STRIPOFFSETS, pos);
     pos = std::copy_n((const uint8_t *)thumbnail.bits(), ts, &fileData[pos]) - fileData.get();
     if (previewWidth > 0) {
-        ts = previewSize();
-        previewIFD.setValue(STRIPBYTES, ts);
-        previewIFD.setValue(STRIPOFFSETS, pos);
-        pos = std::copy_n((const uint8_t *)jpegPreviewData.constData(), ts, &fileData[pos]) - fileData.get();
+        std::vector<uint32_t> stripBytes, stripOffsets;
+        for (const QByteArray & strip : jpegPreviewStrips) {
+            stripBytes.push_back(strip.size());
+            stripOffsets.push_back(pos);
+            pos = std::copy_n((const uint8_t *)strip.constData(), strip.size(), &fileData[pos]) - fileData.get();
+        }
+        previewIFD.setValue(STRIPBYTES, stripBytes.data());
+        previewIFD.setValue(STRIPOFFSETS, stripOffsets.data());
     }
 }
 
@@ -459,6 +495,53 @@ inline void DNG_FloatToFP24(uint32_t input, uint8_t *output) {
 }
 
 
+// From DNG SDK dng_utils.h
+inline uint32_t DNG_HalfToFloat(uint16_t halfValue) {
+    int32_t sign     = (halfValue >> 15) & 0x00000001;
+    int32_t exponent = (halfValue >> 10) & 0x0000001f;
+    int32_t mantissa =  halfValue        & 0x000003ff;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            return (uint32_t)(sign << 31);
+        }
+        while (!(mantissa & 0x00000400)) {
+            mantissa <<= 1;
+            exponent -=  1;
+        }
+        exponent += 1;
+        mantissa &= ~0x00000400;
+    } else if (exponent == 31) {
+        return (uint32_t)((sign << 31) | 0x7f800000 | (mantissa << 13));
+    }
+    exponent += (127 - 15);
+    mantissa <<= 13;
+    return (uint32_t)((sign << 31) | (exponent << 23) | mantissa);
+}
+
+
+inline uint32_t DNG_FP24ToFloat(const uint8_t * input) {
+    int32_t sign     = (input [0] >> 7) & 0x01;
+    int32_t exponent = (input [0]     ) & 0x7F;
+    int32_t mantissa = (((int32_t) input [1]) << 8) | input[2];
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            return (uint32_t)(sign << 31);
+        }
+        while (!(mantissa & 0x00010000)) {
+            mantissa <<= 1;
+            exponent -=  1;
+        }
+        exponent += 1;
+        mantissa &= ~0x00010000;
+    } else if (exponent == 127) {
+        return (uint32_t)((sign << 31) | 0x7f800000 | (mantissa << 7));
+    }
+    exponent += 128 - 64;
+    mantissa <<= 7;
+    return (uint32_t)((sign << 31) | (exponent << 23) | mantissa);
+}
+
+
 static void compressFloats(Bytef * dst, int tileWidth, int bytesps) {
     if (bytesps == 2) {
         uint16_t * dst16 = (uint16_t *) dst;
@@ -504,17 +587,55 @@ size_t DngFloatWriter::rawSize() {
 }
 
 
+// The values that a reader decodes from count pixels, as little endian 32-bit floats
+static void decodedFloats(const float * src, int count, int bytesps, uint32_t * dst) {
+    std::copy_n(src, count, (float *)dst);
+    compressFloats((Bytef *)dst, count, bytesps);
+    // Expand in place from the end, so that no value is overwritten before it is read
+    if (bytesps == 2) {
+        const uint16_t * dst16 = (const uint16_t *)dst;
+        for (int i = count - 1; i >= 0; --i) {
+            dst[i] = DNG_HalfToFloat(dst16[i]);
+        }
+    } else if (bytesps == 3) {
+        const uint8_t * dst8 = (const uint8_t *)dst;
+        for (int i = count - 1; i >= 0; --i) {
+            dst[i] = DNG_FP24ToFloat(dst8 + 3 * i);
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        dst[i] = qToLittleEndian(dst[i]);
+    }
+}
+
+
 void DngFloatWriter::writeRawData() {
     size_t tileCount = tilesAcross * tilesDown;
     QVarLengthArray<uint32_t> tileOffsets(tileCount);
     QVarLengthArray<uint32_t> tileBytes(tileCount);
     int bytesps = bps >> 3;
     uLongf dstLen = tileWidth * tileLength * bytesps;
+    bool reuseTiles = tileCache && tileCache->bps == bps && tileCache->width == width
+        && tileCache->height == height && tileCache->tiles.size() == tileCount;
+    if (tileCache && !reuseTiles) {
+        tileCache->bps = bps;
+        tileCache->width = width;
+        tileCache->height = height;
+        tileCache->tiles.assign(tileCount, QByteArray());
+    }
+    std::atomic<size_t> reused(0);
+    // NewRawImageDigest is computed as the DNG SDK does, independently of the tiles and compression of the file:
+    // the MD5 of the MD5s of 256x256 blocks of decoded pixels, in row order, or the MD5 of the only block.
+    const size_t digestSide = 256;
+    const size_t digestAcross = (width + digestSide - 1) / digestSide;
+    std::vector<QByteArray> blockDigests(digestAcross * ((height + digestSide - 1) / digestSide));
 
     #pragma omp parallel
     {
         auto cBuffer = std::make_unique<Bytef[]>(dstLen);
         auto uBuffer = std::make_unique<Bytef[]>(dstLen);
+        // compressFloats works in place, so each row is copied out of the shared plane first
+        auto rowBuffer = std::make_unique<float[]>(tileWidth);
 
         #pragma omp for collapse(2) schedule(dynamic)
         for (size_t y = 0; y < height; y += tileLength) {
@@ -522,12 +643,26 @@ void DngFloatWriter::writeRawData() {
                 size_t t = (y / tileLength) * tilesAcross + (x / tileWidth);
                 size_t thisTileLength = y + tileLength > height ? height - y : tileLength;
                 size_t thisTileWidth = x + tileWidth > width ? width - x : tileWidth;
+                if (reuseTiles && !tileCache->tiles[t].isEmpty()
+                        && !changedArea.intersects(QRect(x, y, thisTileWidth, thisTileLength))) {
+                    const QByteArray & cached = tileCache->tiles[t];
+                    tileBytes[t] = cached.size();
+                    ++reused;
+                    #pragma omp critical
+                    {
+                        tileOffsets[t] = pos;
+                        std::copy_n((const uint8_t *)cached.constData(), tileBytes[t], &fileData[pos]);
+                        pos += tileBytes[t];
+                    }
+                    continue;
+                }
                 if (thisTileLength != tileLength || thisTileWidth != tileWidth) {
                     std::fill_n(uBuffer.get(), dstLen, 0);
                 }
                 for (size_t row = 0; row < thisTileLength; ++row) {
                     Bytef * dst = uBuffer.get() + row*tileWidth*bytesps;
-                    Bytef * src = (Bytef *)&rawData(x, y+row);
+                    std::copy_n(&(*rawData)(x, y+row), thisTileWidth, rowBuffer.get());
+                    Bytef * src = (Bytef *)rowBuffer.get();
                     compressFloats(src, thisTileWidth, bytesps);
                     encodeFPDeltaRow(src, dst, thisTileWidth, tileWidth, bytesps, 2);
                 }
@@ -536,7 +671,14 @@ void DngFloatWriter::writeRawData() {
                 tileBytes[t] = conpressedLength;
                 if (err != Z_OK) {
                     std::cerr << "DNG Deflate: Failed compressing tile " << t << ", with error " << err << std::endl;
+                    // Otherwise the next save would reuse the contents of a previous one
+                    if (tileCache) {
+                        tileCache->tiles[t].clear();
+                    }
                 } else {
+                    if (tileCache) {
+                        tileCache->tiles[t] = QByteArray((const char *)cBuffer.get(), conpressedLength);
+                    }
                     #pragma omp critical
                     {
                         tileOffsets[t] = pos;
@@ -546,8 +688,42 @@ void DngFloatWriter::writeRawData() {
                 }
             }
         }
+
+        auto decoded = std::make_unique<uint32_t[]>(digestSide);
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < blockDigests.size(); ++b) {
+            size_t x = (b % digestAcross) * digestSide, y = (b / digestAcross) * digestSide;
+            size_t blockWidth = std::min(digestSide, width - x), blockLength = std::min(digestSide, height - y);
+            QCryptographicHash md5(QCryptographicHash::Md5);
+            for (size_t row = 0; row < blockLength; ++row) {
+                decodedFloats(&(*rawData)(x, y + row), blockWidth, bytesps, decoded.get());
+                md5.addData(QByteArray::fromRawData((const char *)decoded.get(), blockWidth * 4));
+            }
+            blockDigests[b] = md5.result();
+        }
     }
 
+    QCryptographicHash md5(QCryptographicHash::Md5);
+    QByteArray digest;
+    if (blockDigests.size() == 1) {
+        digest = blockDigests.front();
+    } else {
+        for (const QByteArray & d : blockDigests) {
+            md5.addData(d);
+        }
+        digest = md5.result();
+    }
+    mainIFD.setValue(NEWRAWIMAGEDIGEST, (const uint8_t *)digest.constData());
+    // The unique ID only has to tell raw files apart, so it adds the camera and capture time to the digest
+    md5.reset();
+    md5.addData(digest);
+    md5.addData(QByteArray::fromStdString(params->maker + params->model + params->dateTime));
+    QByteArray uniqueId = md5.result();
+    mainIFD.setValue(RAWDATAUNIQUEID, (const uint8_t *)uniqueId.constData());
+
+    if (reused > 0) {
+        Log::debug("Reused ", (size_t)reused, " of ", tileCount, " compressed tiles");
+    }
     rawIFD.setValue(TILEOFFSETS, tileOffsets.constData());
     rawIFD.setValue(TILEBYTES, tileBytes.constData());
 }
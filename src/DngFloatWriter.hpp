@@ -23,11 +23,15 @@
 #ifndef _DNGFLOATWRITER_HPP_
 #define _DNGFLOATWRITER_HPP_
 
+#include <vector>
 #include <QString>
 #include <QImage>
+#include <QRect>
+#include <QByteArray>
 #include "config.h"
 #include "Array2D.hpp"
 #include "TiffDirectory.hpp"
+#include "ExifTransfer.hpp"
 
 namespace hdrmerge {
 
@@ -35,7 +39,15 @@ class RawParameters;
 
 class DngFloatWriter {
 public:
-    DngFloatWriter() : previewWidth(0), bps(16) {}
+    /// Compressed tiles of a previous write, reused for the tiles that did not change
+    struct TileCache {
+        int bps;
+        uint32_t width, height;
+        std::vector<QByteArray> tiles;
+        TileCache() : bps(0), width(0), height(0) {}
+    };
+
+    DngFloatWriter() : previewWidth(0), bps(16), tileCache(nullptr), exifSource(nullptr) {}
 
     void setPreviewWidth(size_t w) {
         previewWidth = w;
@@ -44,13 +56,26 @@ public:
         bps = b;
     }
     void setPreview(const QImage & p);
-    void write(Array2D<float> && rawPixels, const RawParameters & p, const QString & dstFileName);
+    /// Only the tiles that intersect changed are compressed again
+    void setTileCache(TileCache * cache, QRect changed) {
+        tileCache = cache;
+        changedArea = changed;
+    }
+    /// Metadata already read from the source file, shared between several writers
+    void setExifSource(Exif::Source * source) {
+        exifSource = source;
+    }
+    /// rawPixels is not modified, so that several writers can encode the same plane
+    void write(const Array2D<float> & rawPixels, const RawParameters & p, const QString & dstFileName);
 
 private:
     int previewWidth;
     int bps;
+    TileCache * tileCache;
+    QRect changedArea;
+    Exif::Source * exifSource;
     const RawParameters * params;
-    Array2D<float> rawData;
+    const Array2D<float> * rawData;
     std::unique_ptr<uint8_t[]> fileData;
     size_t pos;
     IFD mainIFD, rawIFD, previewIFD;
@@ -59,7 +84,8 @@ private:
     uint32_t tilesAcross, tilesDown;
     QImage thumbnail;
     QImage preview;
-    QByteArray jpegPreviewData;
+    std::vector<QByteArray> jpegPreviewStrips; ///< Each one a complete JPEG stream of previewStripRows rows
+    static constexpr int previewStripRows = 256;
     uint32_t subIFDoffsets[2];
 
     void createMainIFD();
@@ -100,6 +100,9 @@ DngPropertiesDialog::DngPropertiesDialog(QWidget * parent, Qt::WindowFlags f)
     saveMaskFile->setChecked(saveMask);
     maskFileSelector->setEnabled(saveMask);
 
+    saveSidecarFile = new QCheckBox(tr("Save it, to open these images faster next time"), this);
+    saveSidecarFile->setChecked(saveSidecar);
+
     QWidget * formWidget = new QWidget(this);
     QFormLayout * formLayout = new QFormLayout(formWidget);
     formLayout->addRow(tr("Bits per sample:"), bpsSelector);
@@ -107,6 +110,7 @@ DngPropertiesDialog::DngPropertiesDialog(QWidget * parent, Qt::WindowFlags f)
     formLayout->addRow(tr("Mask blur radius:"), radiusSelector);
     formLayout->addRow(tr("Mask image:"), saveMaskFile);
     formLayout->addRow("", maskFileSelector);
+    formLayout->addRow(tr("Analysis:"), saveSidecarFile);
     formWidget->setLayout(formLayout);
     layout->addWidget(formWidget, 1);
 
@@ -125,6 +129,7 @@ DngPropertiesDialog::DngPropertiesDialog(QWidget * parent, Qt::WindowFlags f)
 
 void DngPropertiesDialog::accept() {
     saveMask = maskFileSelector->isEnabled();
+    saveSidecar = saveSidecarFile->isChecked();
     maskFileName = QDir::toNativeSeparators(maskFileEditor->text()).toLocal8Bit().constData();
     if (saveOptions->isChecked()) {
         QSettings settings;
@@ -133,6 +138,7 @@ void DngPropertiesDialog::accept() {
         settings.setValue("saveMask", saveMask);
         settings.setValue("maskFileName", maskFileName);
         settings.setValue("featherRadius", featherRadius);
+        settings.setValue("saveSidecar", saveSidecar);
     }
     QDialog::accept();
 }
@@ -145,6 +151,7 @@ void DngPropertiesDialog::loadDefaultOptions() {
     saveMask = settings.value("saveMask", false).toBool();
     maskFileName = settings.value("maskFileName", "%od/%of_mask.png").toString().toLocal8Bit().constData();
     featherRadius = settings.value("featherRadius", 3).toInt();
+    saveSidecar = settings.value("saveSidecar", false).toBool();
 }
 
 
@@ -57,6 +57,7 @@ private:
 
     QLineEdit * maskFileEditor;
     QWidget * maskFileSelector;
+    QCheckBox * saveSidecarFile;
     QCheckBox * saveOptions;
 };
 
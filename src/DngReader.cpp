@@ -0,0 +1,586 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <map>
+#include <vector>
+#include <zlib.h>
+#include <QFile>
+#include "DngReader.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+enum {
+    NEWSUBFILETYPE = 254,
+    IMAGEWIDTH = 256,
+    IMAGELENGTH = 257,
+    BITSPERSAMPLE = 258,
+    COMPRESSION = 259,
+    PHOTOINTERPRETATION = 262,
+    STRIPOFFSETS = 273,
+    SAMPLESPERPIXEL = 277,
+    ROWSPERSTRIP = 278,
+    STRIPBYTES = 279,
+    PREDICTOR = 317,
+    TILEWIDTH = 322,
+    TILELENGTH = 323,
+    TILEOFFSETS = 324,
+    TILEBYTES = 325,
+    SUBIFDS = 330,
+    SAMPLEFORMAT = 339,
+    LINEARIZATIONTABLE = 50712,
+    BLACKLEVELREPEATDIM = 50713,
+    BLACKLEVEL = 50714,
+    BLACKLEVELDELTAH = 50715,
+    BLACKLEVELDELTAV = 50716,
+    WHITELEVEL = 50717,
+    MASKEDAREAS = 50830,
+};
+
+enum {
+    TIFF_UNCOMPRESSED = 1,
+    TIFF_LJPEG = 7,
+    TIFF_DEFLATE = 8,
+    TIFF_CFA = 32803,
+    PREDICTOR_NONE = 1,
+    PREDICTOR_HORIZONTAL = 2,
+    PREDICTOR_HORIZONTALX2 = 34892,
+    PREDICTOR_HORIZONTALX4 = 34893,
+};
+
+
+/// The integer values of a TIFF directory. Rationals are kept if they are whole numbers.
+/// Entries of other types, or with fractions, are present, but empty.
+typedef std::map<uint16_t, std::vector<uint32_t>> Directory;
+
+
+class TiffFile {
+public:
+    TiffFile(const uint8_t * d, size_t s) : data(d), size(s), bigEndian(d[0] == 'M') {}
+
+    uint16_t get16(size_t pos) const {
+        return bigEndian ? (data[pos] << 8) | data[pos + 1] : data[pos] | (data[pos + 1] << 8);
+    }
+    uint32_t get32(size_t pos) const {
+        return bigEndian ? ((uint32_t)get16(pos) << 16) | get16(pos + 2) : get16(pos) | ((uint32_t)get16(pos + 2) << 16);
+    }
+    bool isBigEndian() const {
+        return bigEndian;
+    }
+    /// All the directories, including the SubIFDs of the main chain
+    bool readDirectories(std::vector<Directory> & dirs) const {
+        if (size < 8 || (data[0] != 'I' && data[0] != 'M') || get16(2) != 42) return false;
+        std::vector<uint32_t> pending;
+        for (uint32_t offset = get32(4); offset != 0 && dirs.size() < 64; ) {
+            Directory dir;
+            if (!readDirectory(offset, dir, offset)) return false;
+            if (dir.count(SUBIFDS)) {
+                pending.insert(pending.end(), dir[SUBIFDS].begin(), dir[SUBIFDS].end());
+            }
+            dirs.push_back(std::move(dir));
+        }
+        for (uint32_t offset : pending) {
+            Directory dir;
+            uint32_t next;
+            if (readDirectory(offset, dir, next)) {
+                dirs.push_back(std::move(dir));
+            }
+        }
+        return true;
+    }
+
+private:
+    const uint8_t * data;
+    size_t size;
+    bool bigEndian;
+
+    bool readDirectory(uint32_t offset, Directory & dir, uint32_t & next) const {
+        if ((size_t)offset + 2 > size) return false;
+        uint16_t numEntries = get16(offset);
+        size_t end = offset + 2 + numEntries * 12;
+        if (end + 4 > size) return false;
+        for (size_t pos = offset + 2; pos < end; pos += 12) {
+            uint16_t tag = get16(pos), type = get16(pos + 2);
+            uint32_t count = get32(pos + 4);
+            std::vector<uint32_t> & values = dir[tag];
+            // SHORT, LONG, IFD and RATIONAL
+            int typeSize = type == 3 ? 2 : (type == 4 || type == 13 ? 4 : (type == 5 ? 8 : 0));
+            if (typeSize == 0) continue;
+            size_t valuePos = (size_t)count * typeSize <= 4 ? pos + 8 : get32(pos + 8);
+            if (valuePos + (size_t)count * typeSize > size) return false;
+            values.resize(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                if (typeSize == 8) {
+                    uint32_t num = get32(valuePos + 8 * i), den = get32(valuePos + 8 * i + 4);
+                    if (den == 0 || num % den != 0) {
+                        values.clear();
+                        break;
+                    }
+                    values[i] = num / den;
+                } else {
+                    values[i] = typeSize == 2 ? get16(valuePos + 2 * i) : get32(valuePos + 4 * i);
+                }
+            }
+        }
+        next = get32(end);
+        return true;
+    }
+};
+
+
+/// Bits of the entropy coded segment of a JPEG stream, without the stuffed bytes, up to the next marker
+class JpegBitReader {
+public:
+    JpegBitReader(const uint8_t * begin, const uint8_t * end) : p(begin), end(end), buffer(0), bits(0), marker(false) {}
+
+    uint32_t peek(int n) {
+        if (bits < n) fill();
+        return buffer >> (64 - n);
+    }
+    void consume(int n) {
+        buffer <<= n;
+        bits -= n;
+    }
+    uint32_t get(int n) {
+        if (n == 0) return 0;
+        uint32_t v = peek(n);
+        consume(n);
+        return v;
+    }
+    /// Drops the remaining bits and skips the next restart marker
+    bool restart() {
+        buffer = 0;
+        bits = 0;
+        marker = false;
+        while (p + 1 < end && !(p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7)) ++p;
+        if (p + 1 >= end) return false;
+        p += 2;
+        return true;
+    }
+
+private:
+    const uint8_t * p, * end;
+    uint64_t buffer;
+    int bits;
+    bool marker;
+
+    void fill() {
+        while (bits <= 56) {
+            uint64_t c = 0;
+            if (!marker && p < end) {
+                if (*p != 0xFF) {
+                    c = *p++;
+                } else if (p + 1 < end && p[1] == 0x00) {
+                    c = 0xFF;
+                    p += 2;
+                } else {
+                    // A marker, only zeros from here
+                    marker = true;
+                }
+            }
+            buffer |= c << (56 - bits);
+            bits += 8;
+        }
+    }
+};
+
+
+struct HuffmanTable {
+    /// Length and value of the codes of up to fastBits bits, indexed by the next fastBits bits, 0 if longer
+    static const int fastBits = 9;
+    uint16_t fast[1 << fastBits];
+    int32_t maxCode[17], minCode[17], valuePtr[17];
+    uint8_t values[256];
+    bool defined = false;
+
+    void build(const uint8_t * counts, const uint8_t * vals, int numValues) {
+        std::copy_n(vals, numValues, values);
+        std::fill_n(fast, 1 << fastBits, 0);
+        int32_t code = 0, k = 0;
+        for (int len = 1; len <= 16; ++len) {
+            valuePtr[len] = k;
+            minCode[len] = code;
+            for (int i = 0; i < counts[len - 1]; ++i, ++k, ++code) {
+                if (len <= fastBits) {
+                    int first = code << (fastBits - len);
+                    std::fill_n(&fast[first], 1 << (fastBits - len), (len << 8) | values[k]);
+                }
+            }
+            maxCode[len] = counts[len - 1] ? code - 1 : -1;
+            code <<= 1;
+        }
+        defined = true;
+    }
+
+    /// Returns the next symbol, or -1 if there is no such code
+    int decode(JpegBitReader & in) const {
+        uint32_t next = in.peek(16);
+        uint16_t f = fast[next >> (16 - fastBits)];
+        if (f) {
+            in.consume(f >> 8);
+            return f & 0xFF;
+        }
+        for (int len = fastBits + 1; len <= 16; ++len) {
+            int32_t code = next >> (16 - len);
+            if (code <= maxCode[len]) {
+                in.consume(len);
+                return values[valuePtr[len] + code - minCode[len]];
+            }
+        }
+        return -1;
+    }
+};
+
+
+/// Decodes a lossless JPEG stream into its samples, in order, as DNG stores tiles with it
+static bool decodeLosslessJpeg(const uint8_t * data, size_t size, std::vector<uint16_t> & samples) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    HuffmanTable tables[4];
+    int precision = 0, width = 0, height = 0, numComponents = 0;
+    int componentIds[4], componentTable[4];
+    int predictor = 0, pointTransform = 0, restartInterval = 0;
+    size_t pos = 2;
+    bool scan = false;
+    while (!scan) {
+        while (pos + 4 <= size && data[pos] != 0xFF) ++pos;
+        if (pos + 4 > size) return false;
+        uint8_t marker = data[pos + 1];
+        pos += 2;
+        if (marker == 0xFF || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            if (marker == 0xFF) --pos;
+            continue;
+        }
+        size_t length = (data[pos] << 8) | data[pos + 1];
+        const uint8_t * seg = data + pos + 2;
+        if (length < 2 || pos + length > size) return false;
+        size_t segEnd = length - 2;
+        switch (marker) {
+            case 0xC4: // DHT
+                for (size_t i = 0; i + 17 <= segEnd; ) {
+                    int id = seg[i] & 0x0F;
+                    const uint8_t * counts = seg + i + 1;
+                    int numValues = 0;
+                    for (int j = 0; j < 16; ++j) numValues += counts[j];
+                    if (id > 3 || numValues > 256 || i + 17 + numValues > segEnd) return false;
+                    tables[id].build(counts, seg + i + 17, numValues);
+                    i += 17 + numValues;
+                }
+                break;
+            case 0xC3: // SOF3, lossless with Huffman coding
+                if (segEnd < 6) return false;
+                precision = seg[0];
+                height = (seg[1] << 8) | seg[2];
+                width = (seg[3] << 8) | seg[4];
+                numComponents = seg[5];
+                if (numComponents < 1 || numComponents > 4 || segEnd < 6 + 3 * (size_t)numComponents) return false;
+                for (int c = 0; c < numComponents; ++c) {
+                    componentIds[c] = seg[6 + 3 * c];
+                }
+                break;
+            case 0xC0: case 0xC1: case 0xC2: case 0xC5: case 0xC6: case 0xC7:
+            case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+                return false; // Not lossless, or arithmetic coding
+            case 0xDD: // DRI
+                if (segEnd < 2) return false;
+                restartInterval = (seg[0] << 8) | seg[1];
+                break;
+            case 0xDA: { // SOS
+                if (segEnd < 1 || seg[0] != numComponents || segEnd < 4 + 2 * (size_t)numComponents) return false;
+                for (int c = 0; c < numComponents; ++c) {
+                    if (seg[1 + 2 * c] != componentIds[c]) return false;
+                    componentTable[c] = seg[2 + 2 * c] >> 4;
+                    if (componentTable[c] > 3 || !tables[componentTable[c]].defined) return false;
+                }
+                predictor = seg[1 + 2 * numComponents];
+                pointTransform = seg[3 + 2 * numComponents] & 0x0F;
+                scan = true;
+                break;
+            }
+            case 0xD9: // EOI
+                return false;
+        }
+        pos += length;
+    }
+    if (precision < 2 || precision > 16 || predictor < 1 || predictor > 7 || width == 0 || height == 0
+            || pointTransform >= precision) {
+        return false;
+    }
+
+    JpegBitReader in(data + pos, data + size);
+    const int rowSize = width * numComponents;
+    samples.resize((size_t)rowSize * height);
+    std::vector<int> prev(rowSize), cur(rowSize);
+    const int initial = 1 << (precision - pointTransform - 1);
+    // The first line of the scan, and of each restart interval, only predicts from the left
+    int firstLine = 0, mcus = 0;
+    bool reset = true;
+    for (int row = 0; row < height; ++row) {
+        for (int col = 0; col < width; ++col) {
+            if (restartInterval) {
+                if (mcus == restartInterval) {
+                    if (!in.restart()) return false;
+                    mcus = 0;
+                    firstLine = row;
+                    reset = true;
+                }
+                ++mcus;
+            }
+            for (int c = 0; c < numComponents; ++c) {
+                int length = tables[componentTable[c]].decode(in);
+                if (length < 0 || length > 16) return false;
+                int diff;
+                if (length == 16) {
+                    diff = -32768;
+                } else {
+                    diff = in.get(length);
+                    if (length > 0 && (diff & (1 << (length - 1))) == 0) {
+                        diff -= (1 << length) - 1;
+                    }
+                }
+                int i = col * numComponents + c;
+                int pred;
+                if (reset) {
+                    pred = initial;
+                } else if (row == firstLine) {
+                    pred = cur[i - numComponents];
+                } else if (col == 0) {
+                    pred = prev[i];
+                } else {
+                    int ra = cur[i - numComponents], rb = prev[i], rc = prev[i - numComponents];
+                    switch (predictor) {
+                        case 1: pred = ra; break;
+                        case 2: pred = rb; break;
+                        case 3: pred = rc; break;
+                        case 4: pred = ra + rb - rc; break;
+                        case 5: pred = ra + ((rb - rc) >> 1); break;
+                        case 6: pred = rb + ((ra - rc) >> 1); break;
+                        default: pred = (ra + rb) >> 1; break;
+                    }
+                }
+                cur[i] = (pred + diff) & 0xFFFF;
+            }
+            reset = false;
+        }
+        uint16_t * dst = &samples[(size_t)row * rowSize];
+        for (int i = 0; i < rowSize; ++i) {
+            dst[i] = cur[i] << pointTransform;
+        }
+        std::swap(prev, cur);
+    }
+    return true;
+}
+
+
+/// A tile or strip, with its size in the image, which may exceed the image for tiles
+struct Block {
+    uint32_t x, y, width, length;
+    uint32_t offset, bytes;
+};
+
+
+static bool decodeBlock(const TiffFile & tiff, const uint8_t * data, const Block & b, int compression, int bps,
+                        int predictor, uint32_t width, uint32_t height, uint16_t * raw) {
+    const size_t numSamples = (size_t)b.width * b.length;
+    std::vector<uint16_t> samples;
+    if (compression == TIFF_LJPEG) {
+        if (!decodeLosslessJpeg(data + b.offset, b.bytes, samples) || samples.size() < numSamples) return false;
+    } else {
+        const uint8_t * src = data + b.offset;
+        std::vector<uint8_t> inflated;
+        const size_t numBytes = numSamples * (bps >> 3);
+        if (compression == TIFF_DEFLATE) {
+            inflated.resize(numBytes);
+            uLongf length = numBytes;
+            if (uncompress(inflated.data(), &length, src, b.bytes) != Z_OK || length != numBytes) return false;
+            src = inflated.data();
+        } else if (b.bytes < numBytes) {
+            return false;
+        }
+        samples.resize(numSamples);
+        for (size_t i = 0; i < numSamples; ++i) {
+            samples[i] = bps == 8 ? src[i] :
+                (tiff.isBigEndian() ? (src[2 * i] << 8) | src[2 * i + 1] : src[2 * i] | (src[2 * i + 1] << 8));
+        }
+        if (compression == TIFF_DEFLATE && predictor != PREDICTOR_NONE) {
+            // The differences are taken between samples of the same pixel position, with one sample per
+            // pixel, and they wrap around at the sample width
+            int distance = predictor == PREDICTOR_HORIZONTALX4 ? 4 : (predictor == PREDICTOR_HORIZONTALX2 ? 2 : 1);
+            const uint16_t mask = bps == 8 ? 0xFF : 0xFFFF;
+            for (uint32_t y = 0; y < b.length; ++y) {
+                uint16_t * row = &samples[(size_t)y * b.width];
+                for (uint32_t x = distance; x < b.width; ++x) {
+                    row[x] = (row[x] + row[x - distance]) & mask;
+                }
+            }
+        }
+    }
+    uint32_t rows = std::min(b.length, height - b.y), cols = std::min(b.width, width - b.x);
+    for (uint32_t y = 0; y < rows; ++y) {
+        std::copy_n(&samples[(size_t)y * b.width], cols, &raw[(size_t)(b.y + y) * width + b.x]);
+    }
+    return true;
+}
+
+
+// The levels as LibRaw would leave them. Patterns larger than 2x2, fractional levels and
+// deltas are left to LibRaw.
+static bool readLevels(const Directory & dir, int bps, DngReader::Levels & levels) {
+    auto entry = [&] (uint16_t tag) {
+        auto it = dir.find(tag);
+        return it == dir.end() ? nullptr : &it->second;
+    };
+    if (entry(BLACKLEVELDELTAH) || entry(BLACKLEVELDELTAV)) return false;
+    levels.white = (1u << bps) - 1;
+    if (auto white = entry(WHITELEVEL)) {
+        if (white->empty()) return false;
+        levels.white = (*white)[0];
+    }
+    levels.blackRows = levels.blackCols = 1;
+    if (auto dim = entry(BLACKLEVELREPEATDIM)) {
+        if (dim->size() != 2) return false;
+        levels.blackRows = (*dim)[0];
+        levels.blackCols = (*dim)[1];
+    }
+    if ((levels.blackRows != 1 && levels.blackRows != 2) || (levels.blackCols != 1 && levels.blackCols != 2)) {
+        return false;
+    }
+    size_t numBlack = levels.blackRows * levels.blackCols;
+    std::fill_n(levels.black, 4, 0);
+    if (auto black = entry(BLACKLEVEL)) {
+        if (black->size() != numBlack) return false;
+        std::copy(black->begin(), black->end(), levels.black);
+    }
+    return true;
+}
+
+
+bool DngReader::decode(const QString & fileName, uint32_t width, uint32_t height, uint16_t * raw, Levels * levels) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    const size_t size = file.size();
+    QByteArray contents;
+    const uint8_t * data = file.map(0, size);
+    if (data == nullptr) {
+        contents = file.readAll();
+        data = (const uint8_t *)contents.constData();
+    }
+    TiffFile tiff(data, size);
+    std::vector<Directory> dirs;
+    if (!tiff.readDirectories(dirs)) return false;
+
+    auto value = [] (const Directory & dir, uint16_t tag, uint32_t def) {
+        auto it = dir.find(tag);
+        return it == dir.end() || it->second.empty() ? def : it->second[0];
+    };
+    const Directory * raw0 = nullptr;
+    for (const Directory & dir : dirs) {
+        if (value(dir, NEWSUBFILETYPE, 0) == 0 && value(dir, PHOTOINTERPRETATION, 0) == TIFF_CFA
+                && value(dir, IMAGEWIDTH, 0) == width && value(dir, IMAGELENGTH, 0) == height) {
+            raw0 = &dir;
+            break;
+        }
+    }
+    if (raw0 == nullptr) {
+        Log::debug("DngReader: no CFA image of ", width, 'x', height, " in ", fileName);
+        return false;
+    }
+    const Directory & dir = *raw0;
+    int compression = value(dir, COMPRESSION, TIFF_UNCOMPRESSED);
+    int bps = value(dir, BITSPERSAMPLE, 1);
+    int predictor = value(dir, PREDICTOR, PREDICTOR_NONE);
+    // The predictors are only undone for one sample per pixel
+    bool supported = value(dir, SAMPLESPERPIXEL, 1) == 1 && value(dir, SAMPLEFORMAT, 1) == 1
+        && !dir.count(LINEARIZATIONTABLE) && !dir.count(MASKEDAREAS);
+    if (compression == TIFF_LJPEG) {
+        supported = supported && bps <= 16;
+    } else if (compression == TIFF_UNCOMPRESSED || compression == TIFF_DEFLATE) {
+        supported = supported && (bps == 8 || bps == 16);
+        supported = supported && (compression == TIFF_UNCOMPRESSED || predictor == PREDICTOR_NONE
+            || predictor == PREDICTOR_HORIZONTAL || predictor == PREDICTOR_HORIZONTALX2 || predictor == PREDICTOR_HORIZONTALX4);
+    } else {
+        supported = false;
+    }
+    if (!supported) {
+        Log::debug("DngReader: unsupported raw image, compression ", compression, ", ", bps, " bits, in ", fileName);
+        return false;
+    }
+    if (levels != nullptr && !readLevels(dir, bps, *levels)) {
+        Log::debug("DngReader: unsupported black or white levels in ", fileName);
+        return false;
+    }
+
+    std::vector<Block> blocks;
+    bool tiled = dir.count(TILEOFFSETS);
+    const std::vector<uint32_t> empty;
+    auto entry = [&] (uint16_t tag) -> const std::vector<uint32_t> & {
+        auto it = dir.find(tag);
+        return it == dir.end() ? empty : it->second;
+    };
+    const std::vector<uint32_t> & offsets = entry(tiled ? TILEOFFSETS : STRIPOFFSETS);
+    const std::vector<uint32_t> & byteCounts = entry(tiled ? TILEBYTES : STRIPBYTES);
+    if (tiled) {
+        uint32_t tileWidth = value(dir, TILEWIDTH, 0), tileLength = value(dir, TILELENGTH, 0);
+        if (tileWidth == 0 || tileLength == 0) return false;
+        uint32_t tilesAcross = (width + tileWidth - 1) / tileWidth;
+        uint32_t tilesDown = (height + tileLength - 1) / tileLength;
+        // Every tile must be there, or some of the image would be left undecoded
+        if (offsets.size() < (size_t)tilesAcross * tilesDown) return false;
+        for (uint32_t t = 0; t < tilesAcross * tilesDown; ++t) {
+            blocks.push_back(Block{ (t % tilesAcross) * tileWidth, (t / tilesAcross) * tileLength,
+                                    tileWidth, tileLength, offsets[t], 0 });
+        }
+    } else {
+        uint32_t rowsPerStrip = std::min(value(dir, ROWSPERSTRIP, height), height);
+        if (rowsPerStrip == 0) return false;
+        uint32_t strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+        if (offsets.size() < strips) return false;
+        for (uint32_t y = 0, s = 0; y < height; y += rowsPerStrip, ++s) {
+            blocks.push_back(Block{ 0, y, width, std::min(rowsPerStrip, height - y), offsets[s], 0 });
+        }
+    }
+    if (blocks.empty() || byteCounts.size() < blocks.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i].bytes = byteCounts[i];
+        if ((size_t)blocks[i].offset + blocks[i].bytes > size) return false;
+    }
+
+    Timer t("Decode DNG");
+    std::atomic<bool> failed(false);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (!failed && !decodeBlock(tiff, data, blocks[i], compression, bps, predictor, width, height, raw)) {
+            failed = true;
+        }
+    }
+    if (failed) {
+        Log::debug("DngReader: failed decoding ", fileName);
+        return false;
+    }
+    return true;
+}
+
+} // namespace hdrmerge
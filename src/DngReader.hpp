@@ -0,0 +1,52 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNGREADER_HPP_
+#define _DNGREADER_HPP_
+
+#include <cstdint>
+#include <QString>
+
+namespace hdrmerge {
+
+/// Decodes the CFA image of a DNG file, decoding its tiles or strips in parallel.
+/// Only integer data without a linearization table is supported, either uncompressed,
+/// lossless JPEG or deflate compressed. Other files are left to LibRaw.
+class DngReader {
+public:
+    /// The white level and the black level pattern of the CFA image, from its DNG tags
+    struct Levels {
+        uint32_t white;
+        uint32_t blackRows, blackCols; ///< Size of the pattern, at most 2x2
+        uint32_t black[4]; ///< By rows
+    };
+
+    /// Decodes the CFA image of width x height pixels into raw, which has room for all of them.
+    /// Returns false if the file has no such image or it is not supported. If levels is given,
+    /// they are filled in too, and the image is not supported if they cannot be read exactly.
+    static bool decode(const QString & fileName, uint32_t width, uint32_t height, uint16_t * raw,
+                       Levels * levels = nullptr);
+};
+
+} // namespace hdrmerge
+
+#endif // _DNGREADER_HPP_
@@ -20,35 +20,131 @@
  *
  */
 
+#include <algorithm>
+#include <cmath>
+#include <iterator>
 #include "EditableMask.hpp"
 
 namespace hdrmerge {
 
-void EditableMask::startAction(bool add, int layer) {
+bool EditableMask::startAction(bool add, int layer) {
+    int oldLayer = add ? layer + 1 : layer;
+    int newLayer = add ? layer : layer + 1;
+    editing = !layerRect(oldLayer).isEmpty() && !layerRect(newLayer).isEmpty();
+    if (!editing) {
+        return false;
+    }
     editActions.erase(nextAction, editActions.end());
     editActions.emplace_back();
     nextAction = editActions.end();
-    editActions.back().oldLayer = add ? layer + 1 : layer;
-    editActions.back().newLayer = add ? layer : layer + 1;
+    editActions.back().oldLayer = oldLayer;
+    editActions.back().newLayer = newLayer;
+    return true;
 }
 
 
-void EditableMask::editPixels(int x, int y, size_t radius) {
+QRect EditableMask::editPixels(int x, int y, size_t radius) {
+    if (!editing) {
+        return QRect();
+    }
     EditAction & e = editActions.back();
-    traceCircle(x, y, radius, [&] (int col, int row, uint8_t & layer) {
-        if (layer == e.oldLayer && isLayerValidAt(e.newLayer, col, row)) {
-            e.points.push_back({col, row});
-            layer = e.newLayer;
+    int x0 = e.started ? e.lastX : x, y0 = e.started ? e.lastY : y;
+    e.started = true;
+    e.lastX = x;
+    e.lastY = y;
+
+    int r = radius;
+    QRect bounds = QRect(QPoint(std::min(x0, x) - r, std::min(y0, y) - r),
+                         QPoint(std::max(x0, x) + r, std::max(y0, y) + r));
+    bounds &= layerRect(e.newLayer) & QRect(0, 0, width, height);
+    if (bounds.isEmpty()) {
+        return QRect();
+    }
+
+    // Distance from each pixel to the segment (x0,y0)-(x,y), that is, the capsule swept by the brush
+    double sx = x - x0, sy = y - y0, len2 = sx*sx + sy*sy, r2 = r*r;
+    auto inside = [&] (int col, int row) {
+        double px = col - x0, py = row - y0;
+        double t = len2 > 0.0 ? std::max(0.0, std::min(1.0, (px*sx + py*sy) / len2)) : 0.0;
+        double dx = px - t*sx, dy = py - t*sy;
+        return dx*dx + dy*dy <= r2;
+    };
+
+    QRect result;
+    for (int row = bounds.top(); row <= bounds.bottom(); ++row) {
+        // The capsule is convex, so each row crosses it in a single run
+        int left = bounds.left(), right = bounds.right();
+        while (left <= right && !inside(left, row)) ++left;
+        while (right >= left && !inside(right, row)) --right;
+        result |= paintRun(e, row, left, right);
+    }
+    e.area |= result;
+    dirtyArea |= result;
+    return result;
+}
+
+
+QRect EditableMask::paintRun(EditAction & e, int row, int left, int right) {
+    QRect result;
+    if (left > right) return result;
+    uint8_t * pixel = &operator()(left, row);
+    for (int col = left; col <= right; ++col, ++pixel) {
+        if (*pixel == e.oldLayer) {
+            int start = col;
+            while (col <= right && *pixel == e.oldLayer) {
+                *pixel++ = e.newLayer;
+                ++col;
+            }
+            e.spans.push_back({row, start, col - 1});
+            result |= QRect(start, row, col - start, 1);
+        }
+    }
+    return result;
+}
+
+
+void EditableMask::swap(EditableMask & other) {
+    auto applied = std::distance(editActions.begin(), nextAction);
+    auto otherApplied = std::distance(other.editActions.begin(), other.nextAction);
+    editActions.swap(other.editActions);
+    nextAction = std::next(editActions.begin(), otherApplied);
+    other.nextAction = std::next(other.editActions.begin(), applied);
+    std::swap(dirtyArea, other.dirtyArea);
+    std::swap(editing, other.editing);
+    Array2D<uint8_t> tmp(static_cast<Array2D<uint8_t> &&>(*this));
+    Array2D<uint8_t>::operator=(static_cast<Array2D<uint8_t> &&>(other));
+    static_cast<Array2D<uint8_t> &>(other) = std::move(tmp);
+}
+
+
+void EditableMask::replay(const EditableMask & src, int scale, int dx, int dy) {
+    editing = false;
+    // Undone actions are not carried over
+    for (auto a = src.editActions.begin(); a != src.nextAction; ++a) {
+        editActions.erase(nextAction, editActions.end());
+        editActions.emplace_back();
+        nextAction = editActions.end();
+        EditAction & e = editActions.back();
+        e.oldLayer = a->oldLayer;
+        e.newLayer = a->newLayer;
+        QRect valid = layerRect(e.newLayer) & QRect(0, 0, width, height);
+        for (auto & s : a->spans) {
+            QRect r = QRect(s.x0 * scale + dx, s.y * scale + dy, (s.x1 - s.x0 + 1) * scale, scale) & valid;
+            for (int row = r.top(); row <= r.bottom(); ++row) {
+                e.area |= paintRun(e, row, r.left(), r.right());
+            }
         }
-    });
+        dirtyArea |= e.area;
+    }
 }
 
 
 QRect EditableMask::undo() {
     QRect result;
+    editing = false;
     if (nextAction != editActions.begin()) {
         --nextAction;
-        result = modifyLayer(nextAction->points, nextAction->oldLayer);
+        result = modifyLayer(*nextAction, nextAction->oldLayer);
     }
     return result;
 }
@@ -56,25 +152,21 @@ QRect EditableMask::undo() {
 
 QRect EditableMask::redo() {
     QRect result;
+    editing = false;
     if (nextAction != editActions.end()) {
-        result = modifyLayer(nextAction->points, nextAction->newLayer);
+        result = modifyLayer(*nextAction, nextAction->newLayer);
         ++nextAction;
     }
     return result;
 }
 
 
-QRect EditableMask::modifyLayer(const std::list<QPoint> & points, int layer) {
-    if (points.empty()) {
-        return QRect(0, 0, 0, 0);
-    } else {
-        QRect a(points.front(), points.front());
-        for (auto p : points) {
-            operator()(p.x(), p.y()) = layer;
-            a = a.united(QRect(p, p));
-        }
-        return a;
+QRect EditableMask::modifyLayer(const EditAction & action, int layer) {
+    for (auto & s : action.spans) {
+        std::fill_n(&operator()(s.x0, s.y), s.x1 - s.x0 + 1, layer);
     }
+    dirtyArea |= action.area;
+    return action.area;
 }
 
 }
@@ -25,6 +25,7 @@
 
 #include <cstdint>
 #include <list>
+#include <vector>
 #include <QRect>
 #include "Array2D.hpp"
 
@@ -32,14 +33,20 @@ namespace hdrmerge {
 
 class EditableMask : public Array2D<uint8_t> {
 public:
-    EditableMask() : nextAction(editActions.end()) {}
+    EditableMask() : nextAction(editActions.end()), editing(false) {}
     void reset() {
         editActions.clear();
         nextAction = editActions.end();
+        dirtyArea = QRect();
+        editing = false;
     }
 
-    void startAction(bool add, int layer);
-    void editPixels(int x, int y, size_t radius);
+    /// Moves the pixels of layer to the previous one if add, or to the next one otherwise. Returns false,
+    /// and starts no action, when one of them does not exist, like the next layer of the last one.
+    bool startAction(bool add, int layer);
+    /// Paints the capsule swept by the brush since the last call, returns the modified area.
+    /// It does nothing after an undo, a redo or a refused startAction, until another action starts.
+    QRect editPixels(int x, int y, size_t radius);
     bool canUndo() const {
         return nextAction != editActions.begin();
     }
@@ -48,18 +55,41 @@ public:
     }
     QRect undo();
     QRect redo();
+    /// The area modified by edits, undos and redos since the last call to clearDirtyArea
+    QRect getDirtyArea() const {
+        return dirtyArea;
+    }
+    void clearDirtyArea() {
+        dirtyArea = QRect();
+    }
+    void swap(EditableMask & other);
+    /// Applies the edits done on another mask, mapping its (x, y) to (x * scale + dx, y * scale + dy)
+    void replay(const EditableMask & src, int scale, int dx, int dy);
 
 private:
+    /// A horizontal run of pixels, from x0 to x1 both included
+    struct Span {
+        int y, x0, x1;
+    };
+
     struct EditAction {
         int oldLayer, newLayer;
-        std::list<QPoint> points;
+        std::vector<Span> spans;
+        QRect area;
+        bool started;
+        int lastX, lastY;
+        EditAction() : started(false), lastX(0), lastY(0) {}
     };
 
     std::list<EditAction> editActions;
     std::list<EditAction>::iterator nextAction;
+    QRect dirtyArea;
+    bool editing; ///< The last action in editActions is the one being painted
 
-    QRect modifyLayer(const std::list<QPoint> & points, int oldayer);
-    virtual bool isLayerValidAt(int layer, int x, int y) const = 0;
+    QRect paintRun(EditAction & e, int row, int left, int right);
+    QRect modifyLayer(const EditAction & action, int layer);
+    /// The area of the mask where a layer has valid pixels
+    virtual QRect layerRect(int layer) const = 0;
 };
 
 } // namespace hdrmerge
@@ -22,6 +22,8 @@
 
 #include <exiv2/exiv2.hpp>
 #include <iostream>
+#include <string>
+#include <unordered_set>
 #include "ExifTransfer.hpp"
 #include "Log.hpp"
 
@@ -29,17 +31,19 @@ namespace hdrmerge {
 
 class ExifTransfer {
 public:
-    ExifTransfer(const QString & srcFile, const QString & dstFile,
+    ExifTransfer(Exif::Source & source, const QString & dstFile,
                  const uint8_t * data, size_t dataSize)
-    : srcFile(srcFile), dstFile(dstFile), data(data), dataSize(dataSize) {}
+    : source(source), dstFile(dstFile), data(data), dataSize(dataSize) {}
 
     void copyMetadata();
 
 private:
-    QString srcFile, dstFile;
+    Exif::Source & source;
+    QString dstFile;
     const uint8_t * data;
     size_t dataSize;
-    std::unique_ptr<Exiv2::Image> src, dst;
+    Exiv2::Image * src;
+    std::unique_ptr<Exiv2::Image> dst;
 
     void copyXMP();
     void copyIPTC();
@@ -47,14 +51,36 @@ private:
 };
 
 
+Exif::Source::Source(const QString & srcFile) {
+    try {
+        image.reset(Exiv2::ImageFactory::open(srcFile.toLocal8Bit().constData()).release());
+        image->readMetadata();
+    } catch (Exiv2::Error & e) {
+        std::cerr << "Exiv2 error: " << e.what() << std::endl;
+        image.reset();
+    }
+}
+
+
+Exif::Source::~Source() {}
+
+
 void hdrmerge::Exif::transfer(const QString & srcFile, const QString & dstFile,
                  const uint8_t * data, size_t dataSize) {
-    ExifTransfer exif(srcFile, dstFile, data, dataSize);
+    Source source(srcFile);
+    transfer(source, dstFile, data, dataSize);
+}
+
+
+void hdrmerge::Exif::transfer(Source & source, const QString & dstFile,
+                 const uint8_t * data, size_t dataSize) {
+    ExifTransfer exif(source, dstFile, data, dataSize);
     exif.copyMetadata();
 }
 
 
 void ExifTransfer::copyMetadata() {
+    Timer t("Transfer metadata");
     try {
         // .reset(.release()) accounts for old versions of Exiv2 that return an auto_ptr
         dst.reset(Exiv2::ImageFactory::open(data, dataSize).release());
@@ -63,16 +89,25 @@ void ExifTransfer::copyMetadata() {
         std::cerr << "Exiv2 error: " << e.what() << std::endl;
         return;
     }
-    try {
-        src.reset(Exiv2::ImageFactory::open(srcFile.toLocal8Bit().constData()).release());
-        src->readMetadata();
-        copyXMP();
-        copyIPTC();
-        copyEXIF();
-    } catch (Exiv2::Error & e) {
-        std::cerr << "Exiv2 error: " << e.what() << std::endl;
-        // At least we have to set the SubImage1 file type to Primary Image
-        dst->exifData()["Exif.SubImage1.NewSubfileType"] = 0;
+    {
+        // The source is shared by every output written from the same stack
+        std::lock_guard<std::mutex> lock(source.mutex);
+        src = source.image.get();
+        bool copied = false;
+        if (src != nullptr) {
+            try {
+                copyXMP();
+                copyIPTC();
+                copyEXIF();
+                copied = true;
+            } catch (Exiv2::Error & e) {
+                std::cerr << "Exiv2 error: " << e.what() << std::endl;
+            }
+        }
+        if (!copied) {
+            // At least we have to set the SubImage1 file type to Primary Image
+            dst->exifData()["Exif.SubImage1.NewSubfileType"] = 0;
+        }
     }
     try {
         dst->writeMetadata();
@@ -86,11 +121,23 @@ void ExifTransfer::copyMetadata() {
 }
 
 
+// The findKey methods of Exiv2 are linear searches, so the keys already in the destination are indexed once
+template <typename Data> static std::unordered_set<std::string> keysOf(const Data & data) {
+    std::unordered_set<std::string> keys;
+    keys.reserve(data.count());
+    for (const auto & datum : data) {
+        keys.insert(datum.key());
+    }
+    return keys;
+}
+
+
 void ExifTransfer::copyXMP() {
     const Exiv2::XmpData & srcXmp = src->xmpData();
     Exiv2::XmpData & dstXmp = dst->xmpData();
+    std::unordered_set<std::string> dstKeys = keysOf(dstXmp);
     for (const auto & datum : srcXmp) {
-        if (datum.groupName() != "tiff" && dstXmp.findKey(Exiv2::XmpKey(datum.key())) == dstXmp.end()) {
+        if (datum.groupName() != "tiff" && dstKeys.insert(datum.key()).second) {
             dstXmp.add(datum);
         }
     }
@@ -100,8 +147,9 @@ void ExifTransfer::copyXMP() {
 void ExifTransfer::copyIPTC() {
     const Exiv2::IptcData & srcIptc = src->iptcData();
     Exiv2::IptcData & dstIptc = dst->iptcData();
+    std::unordered_set<std::string> dstKeys = keysOf(dstIptc);
     for (const auto & datum : srcIptc) {
-        if (dstIptc.findKey(Exiv2::IptcKey(datum.key())) == dstIptc.end()) {
+        if (dstKeys.insert(datum.key()).second) {
             dstIptc.add(datum);
         }
     }
@@ -109,7 +157,7 @@ void ExifTransfer::copyIPTC() {
 
 
 static bool excludeExifDatum(const Exiv2::Exifdatum & datum) {
-    static const char * previewKeys[] {
+    static const std::unordered_set<std::string> previewKeys {
         "Exif.OlympusCs.PreviewImageStart",
         "Exif.OlympusCs.PreviewImageLength",
         "Exif.Thumbnail.JPEGInterchangeFormat",
@@ -131,16 +179,15 @@ static bool excludeExifDatum(const Exiv2::Exifdatum & datum) {
         "Exif.SamsungPreview.JPEGInterchangeFormat",
         "Exif.SamsungPreview.JPEGInterchangeFormatLength"
     };
-    for (const char * pkey : previewKeys) {
-        if (datum.key() == pkey) {
-            return true;
-        }
+    if (previewKeys.count(datum.key())) {
+        return true;
     }
+    const std::string group = datum.groupName();
     return
-        datum.groupName().substr(0, 5) == "Thumb" ||
-        datum.groupName().substr(0, 8) == "SubThumb" ||
-        datum.groupName().substr(0, 5) == "Image" ||
-        datum.groupName().substr(0, 8) == "SubImage";
+        group.compare(0, 5, "Thumb") == 0 ||
+        group.compare(0, 8, "SubThumb") == 0 ||
+        group.compare(0, 5, "Image") == 0 ||
+        group.compare(0, 8, "SubImage") == 0;
 }
 
 
@@ -172,8 +219,9 @@ void ExifTransfer::copyEXIF() {
     // Exiv2 wouldn't modify SubImage1 tags if it was set before
     dstExif["Exif.SubImage1.NewSubfileType"] = 0u;
 
+    std::unordered_set<std::string> dstKeys = keysOf(dstExif);
     for (const auto & datum : srcExif) {
-        if (!excludeExifDatum(datum) && dstExif.findKey(Exiv2::ExifKey(datum.key())) == dstExif.end()) {
+        if (!excludeExifDatum(datum) && dstKeys.insert(datum.key()).second) {
             dstExif.add(datum);
         }
     }
@@ -23,13 +23,35 @@
 #ifndef _EXIFTRANSFER_HPP_
 #define _EXIFTRANSFER_HPP_
 
+#include <memory>
+#include <mutex>
 #include <QString>
 
+namespace Exiv2 {
+    class Image;
+}
+
 namespace hdrmerge {
 
+    class ExifTransfer;
+
     namespace Exif {
+        /// The metadata of a source file, read once and transferred to several outputs
+        class Source {
+        public:
+            Source(const QString & srcFile);
+            ~Source();
+
+        private:
+            friend class hdrmerge::ExifTransfer;
+            std::unique_ptr<Exiv2::Image> image;
+            std::mutex mutex;
+        };
+
         void transfer(const QString & srcFile, const QString & dstFile,
                  const uint8_t * data, size_t dataSize);
+        void transfer(Source & src, const QString & dstFile,
+                 const uint8_t * data, size_t dataSize);
     }
 
 }
@@ -20,6 +20,11 @@
  *
  */
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include <QRect>
 #include "Image.hpp"
 #include "Bitmap.hpp"
 #include "Histogram.hpp"
@@ -57,10 +62,47 @@ void Image::buildImage(uint16_t * rawImage, const RawParameters & params) {
 }
 
 
+void Image::buildHalfImage(uint16_t * rawImage, const RawParameters & params, int periodX, int periodY) {
+    resize((params.width / (2 * periodX)) * periodX, (params.height / (2 * periodY)) * periodY);
+    // Same brightness as the full size image, so that it takes the same place in a stack.
+    // The sum is exact, whatever the order.
+    brightness = 0.0;
+    #pragma omp parallel for reduction(+:brightness)
+    for (size_t y = 0; y < params.height; ++y) {
+        const uint16_t * row = rawImage + (y + params.topMargin) * params.rawWidth + params.leftMargin;
+        for (size_t x = 0; x < params.width; ++x) {
+            brightness += row[x];
+        }
+    }
+    brightness /= params.width * params.height;
+    response.setLinear(params.max == 0 ? 1.0 : 65535.0 / params.max);
+    bool black = params.hasBlack();
+    auto rawAt = [&] (size_t x, size_t y) -> uint16_t {
+        uint16_t v = rawImage[(y + params.topMargin) * params.rawWidth + x + params.leftMargin];
+        uint16_t b = black ? params.blackAt(x, y) : 0;
+        return v > b ? v - b : 0;
+    };
+    // Each pixel takes the maximum of the four pixels of its color around it,
+    // so that saturated areas are still detected as such
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < height; ++y) {
+        size_t y0 = 2 * (y - y % periodY) + y % periodY, y1 = y0 + periodY;
+        for (size_t x = 0; x < width; ++x) {
+            size_t x0 = 2 * (x - x % periodX) + x % periodX, x1 = x0 + periodX;
+            (*this)(x, y) = std::max(std::max(rawAt(x0, y0), rawAt(x1, y0)),
+                                     std::max(rawAt(x0, y1), rawAt(x1, y1)));
+        }
+    }
+    max = size() ? *std::max_element(begin(), end()) : 0;
+}
+
+
 Image & Image::operator=(Image && move) {
     Array2D<uint16_t>::operator=(std::move(move));
     filename = move.filename;
     scaled.swap(move.scaled);
+    alignPeriodX = move.alignPeriodX;
+    alignPeriodY = move.alignPeriodY;
     satThreshold = move.satThreshold;
     max = move.max;
     brightness = move.brightness;
@@ -70,6 +112,77 @@ Image & Image::operator=(Image && move) {
 }
 
 
+Image Image::halfSize(int periodX, int periodY) const {
+    Image result;
+    result.filename = filename;
+    result.resize((width / (2 * periodX)) * periodX, (height / (2 * periodY)) * periodY);
+    result.satThreshold = satThreshold;
+    result.response = response;
+    result.halfLightPercent = halfLightPercent;
+    // Each pixel takes the maximum of the four pixels of its color around it,
+    // so that saturated areas are still detected as such
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < result.height; ++y) {
+        size_t y0 = 2 * (y - y % periodY) + y % periodY, y1 = y0 + periodY;
+        for (size_t x = 0; x < result.width; ++x) {
+            size_t x0 = 2 * (x - x % periodX) + x % periodX, x1 = x0 + periodX;
+            result(x, y) = std::max(std::max((*this)(x0, y0), (*this)(x1, y0)),
+                                    std::max((*this)(x0, y1), (*this)(x1, y1)));
+        }
+    }
+    // Same brightness, so that it takes the same place in a stack
+    result.brightness = brightness;
+    result.max = result.size() ? *std::max_element(result.begin(), result.end()) : 0;
+    return result;
+}
+
+
+void Image::writeAnalysis(QDataStream & out) const {
+    out << (quint64)width << (quint64)height << (qint32)dx << (qint32)dy;
+    out << response.threshold << response.linear;
+    // The spline is saved as the values and derivatives at its nodes, which rebuild it exactly
+    alglib::ae_int_t n;
+    alglib::real_2d_array table;
+    alglib::spline1dunpack(response.nonLinear, n, table);
+    out << (qint32)n;
+    for (alglib::ae_int_t i = 0; i < n - 1; ++i) {
+        out << table[i][0] << table[i][2] << table[i][3];
+    }
+    double t = table[n - 2][1] - table[n - 2][0];
+    out << table[n - 2][1] << table[n - 2][2] + t * (table[n - 2][3] + t * (table[n - 2][4] + t * table[n - 2][5]))
+        << table[n - 2][3] + t * (2.0 * table[n - 2][4] + 3.0 * t * table[n - 2][5]);
+}
+
+
+bool Image::readAnalysis(QDataStream & in, bool apply) {
+    quint64 w, h;
+    qint32 x, y, n;
+    quint16 threshold;
+    double linear;
+    in >> w >> h >> x >> y >> threshold >> linear >> n;
+    if (in.status() != QDataStream::Ok || w != width || h != height || n < 2 || n > 65536) {
+        return false;
+    }
+    alglib::real_1d_array nodes, values, derivatives;
+    nodes.setlength(n);
+    values.setlength(n);
+    derivatives.setlength(n);
+    for (int i = 0; i < n; ++i) {
+        in >> nodes[i] >> values[i] >> derivatives[i];
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+    if (apply) {
+        response.threshold = threshold;
+        response.linear = linear;
+        alglib::spline1dbuildhermite(nodes, values, derivatives, n, response.nonLinear);
+        displace(x - dx, y - dy);
+    }
+    return true;
+}
+
+
 void Image::setSaturationThreshold(uint16_t sat) {
     satThreshold = sat;
     response.threshold = 0.9*sat;
@@ -174,38 +287,194 @@ void Image::computeResponseFunction(const Image & r) {
 }
 
 
-size_t Image::alignWith(const Image & r) {
+// A pixel takes part in the MTB error if it is not too close to the threshold
+static inline bool isUsable(uint16_t v, uint16_t mth, uint16_t tolerance) {
+    return v <= (uint16_t)(mth - tolerance) || v > (uint16_t)(mth + tolerance);
+}
+
+
+// Tiles of the reference level with the most MTB edges, where a misalignment shows up
+static std::vector<QRect> informativeTiles(const Array2D<uint16_t> & ref, uint16_t mth, uint16_t tolerance) {
+    const int tileSize = 16;
+    int w = ref.getWidth(), h = ref.getHeight();
+    std::vector<std::pair<size_t, QRect>> scores;
+    for (int ty = 0; ty < h; ty += tileSize) {
+        for (int tx = 0; tx < w; tx += tileSize) {
+            QRect tile(tx, ty, std::min(tileSize, w - tx), std::min(tileSize, h - ty));
+            size_t edges = 0;
+            for (int y = tile.top(); y <= tile.bottom(); ++y) {
+                for (int x = tile.left(); x <= tile.right(); ++x) {
+                    uint16_t v = ref(x, y);
+                    if (!isUsable(v, mth, tolerance)) continue;
+                    if (x + 1 < w && isUsable(ref(x + 1, y), mth, tolerance) && (v > mth) != (ref(x + 1, y) > mth)) {
+                        ++edges;
+                    }
+                    if (y + 1 < h && isUsable(ref(x, y + 1), mth, tolerance) && (v > mth) != (ref(x, y + 1) > mth)) {
+                        ++edges;
+                    }
+                }
+            }
+            if (edges > 0) {
+                scores.emplace_back(edges, tile);
+            }
+        }
+    }
+    size_t k = std::min(scores.size(), std::max<size_t>(16, scores.size() / 8));
+    std::partial_sort(scores.begin(), scores.begin() + k, scores.end(),
+        [] (const std::pair<size_t, QRect> & a, const std::pair<size_t, QRect> & b) {
+            return a.first > b.first;
+        });
+    std::vector<QRect> result;
+    for (size_t i = 0; i < k; ++i) {
+        result.push_back(scores[i].second);
+    }
+    return result;
+}
+
+
+// 0 if the pixel is too close to the threshold, 1 below it and 2 above it
+static inline uint8_t mtbClass(uint16_t v, uint16_t mth, uint16_t tolerance) {
+    return isUsable(v, mth, tolerance) ? (v > mth ? 2 : 1) : 0;
+}
+
+
+// Same error as the bitmaps in alignWith compute, only inside tiles, at the nine offsets around
+// (dx, dy). Each pixel is classified once, not once per offset.
+static void tilesErrors(const Array2D<uint16_t> & ref, uint16_t mth1, uint16_t tol1,
+                        const Array2D<uint16_t> & img, uint16_t mth2, uint16_t tol2,
+                        const std::vector<QRect> & tiles, int dx, int dy, size_t errors[9]) {
+    int w = img.getWidth(), h = img.getHeight();
+    std::fill_n(errors, 9, 0);
+    #pragma omp parallel
+    {
+        size_t errorsthr[9] = {};
+        std::vector<uint8_t> c1, c2;
+        #pragma omp for schedule(dynamic) nowait
+        for (size_t t = 0; t < tiles.size(); ++t) {
+            const QRect & tile = tiles[t];
+            int tw = tile.width(), th = tile.height();
+            // The image, displaced by (dx, dy), with one more pixel around for the other offsets
+            c1.resize(tw * th);
+            c2.resize((tw + 2) * (th + 2));
+            for (int y = 0; y < th; ++y) {
+                for (int x = 0; x < tw; ++x) {
+                    c1[y * tw + x] = mtbClass(ref(tile.left() + x, tile.top() + y), mth1, tol1);
+                }
+            }
+            for (int y = 0; y < th + 2; ++y) {
+                int y2 = tile.top() + y - 1 - dy;
+                for (int x = 0; x < tw + 2; ++x) {
+                    int x2 = tile.left() + x - 1 - dx;
+                    bool inside = x2 >= 0 && x2 < w && y2 >= 0 && y2 < h;
+                    c2[y * (tw + 2) + x] = inside ? mtbClass(img(x2, y2), mth2, tol2) : 0;
+                }
+            }
+            // At offset (dx + i, dy + j), the pixel (x, y) of the tile is compared with (x - i, y - j)
+            for (int j = -1; j <= 1; ++j) {
+                for (int i = -1; i <= 1; ++i) {
+                    size_t error = 0;
+                    for (int y = 0; y < th; ++y) {
+                        const uint8_t * row1 = &c1[y * tw];
+                        const uint8_t * row2 = &c2[(y + 1 - j) * (tw + 2) + 1 - i];
+                        for (int x = 0; x < tw; ++x) {
+                            error += (row1[x] & row2[x]) == 0 && (row1[x] | row2[x]) == 3;
+                        }
+                    }
+                    errorsthr[(j + 1) * 3 + i + 1] += error;
+                }
+            }
+        }
+        #pragma omp critical
+        for (int k = 0; k < 9; ++k) {
+            errors[k] += errorsthr[k];
+        }
+    }
+}
+
+
+// Builds the histogram of every step-th pixel of every step-th row
+static Histogram sampledHistogram(const Array2D<uint16_t> & a, size_t step) {
+    if (step <= 1) {
+        return Histogram(a.cbegin(), a.cend());
+    }
+    Histogram result;
+    for (size_t y = 0; y < a.getHeight(); y += step) {
+        for (size_t x = 0; x < a.getWidth(); x += step) {
+            result.addValue(a(x, y));
+        }
+    }
+    return result;
+}
+
+
+size_t Image::alignWith(const Image & r, bool sampled) {
     dx = dy = 0;
+    // Tiles are chosen at this level, and the finer ones are only compared inside them
+    const int tileLevel = std::min(3, scaleSteps - 1);
+    std::vector<QRect> tiles;
     const double tolerance = 1.0/16;
-    Histogram histFull(begin(), end());
+    // When sampled, the thresholds come from a sparse histogram, as many samples as the tile level has.
+    // The full image is sampled with an odd step, so that all the colors of the CFA are counted.
+    Histogram histFull = sampledHistogram(*this, sampled ? 7 : 1);
     double halfLightPercent = histFull.getFraction(satThreshold) / 2.0;
     size_t totalError = 0;
     for (int s = scaleSteps - 1; s >= 0; --s) {
-        size_t curWidth = width >> (s + 1);
-        size_t curHeight = height >> (s + 1);
+        size_t curWidth = scaled[s].getWidth();
+        size_t curHeight = scaled[s].getHeight();
         size_t minError = curWidth*curHeight;
-        Histogram hist1(r.scaled[s].begin(), r.scaled[s].end());
-        Histogram hist2(scaled[s].begin(), scaled[s].end());
+        bool sampledLevel = sampled && s < tileLevel && !tiles.empty();
+        size_t histStep = sampledLevel ? 1 << (tileLevel - s) : 1;
+        Histogram hist1 = sampledHistogram(r.scaled[s], histStep);
+        Histogram hist2 = sampledHistogram(scaled[s], histStep);
         uint16_t mth1 = hist1.getPercentile(halfLightPercent);
         uint16_t mth2 = hist2.getPercentile(halfLightPercent);
         uint16_t tolPixels1 = (uint16_t)std::floor(mth1*tolerance);
         uint16_t tolPixels2 = (uint16_t)std::floor(mth2*tolerance);
-        Bitmap mtb1(curWidth, curHeight), mtb2(curWidth, curHeight),
-        excl1(curWidth, curHeight), excl2(curWidth, curHeight);
-        mtb1.mtb(r.scaled[s].begin(), mth1);
-        mtb2.mtb(scaled[s].begin(), mth2);
-        excl1.exclusion(r.scaled[s].begin(), mth1, tolPixels1);
-        excl2.exclusion(scaled[s].begin(), mth2, tolPixels2);
-        Bitmap shiftMtb(curWidth, curHeight), shiftExcl(curWidth, curHeight);
-        int curDx = dx, curDy = dy;
-        for (int i = -1; i <= 1; ++i) {
-            for (int j = -1; j <= 1; ++j) {
-                shiftMtb.shift(mtb2, curDx + i, curDy + j);
-                shiftExcl.shift(excl2, curDx + i, curDy + j);
+        std::function<size_t(int, int)> error;
+        // Only the dense levels need the bitmaps
+        Bitmap mtb1, mtb2, excl1, excl2, shiftMtb, shiftExcl;
+        size_t sampledErrors[9];
+        if (sampledLevel) {
+            int scale = tileLevel - s;
+            std::vector<QRect> levelTiles;
+            minError = 0;
+            for (const QRect & t : tiles) {
+                levelTiles.push_back(QRect(t.x() << scale, t.y() << scale, t.width() << scale, t.height() << scale)
+                    & QRect(0, 0, curWidth, curHeight));
+                minError += levelTiles.back().width() * levelTiles.back().height();
+            }
+            tilesErrors(r.scaled[s], mth1, tolPixels1, scaled[s], mth2, tolPixels2, levelTiles, dx, dy, sampledErrors);
+            int curDx = dx, curDy = dy;
+            error = [&, curDx, curDy] (int ox, int oy) {
+                return sampledErrors[(oy - curDy + 1) * 3 + ox - curDx + 1];
+            };
+        } else {
+            if (sampled && s == tileLevel) {
+                tiles = informativeTiles(r.scaled[s], mth1, tolPixels1);
+            }
+            mtb1.resize(curWidth, curHeight);
+            mtb2.resize(curWidth, curHeight);
+            excl1.resize(curWidth, curHeight);
+            excl2.resize(curWidth, curHeight);
+            shiftMtb.resize(curWidth, curHeight);
+            shiftExcl.resize(curWidth, curHeight);
+            mtb1.mtb(r.scaled[s].begin(), mth1);
+            mtb2.mtb(scaled[s].begin(), mth2);
+            excl1.exclusion(r.scaled[s].begin(), mth1, tolPixels1);
+            excl2.exclusion(scaled[s].begin(), mth2, tolPixels2);
+            error = [&] (int ox, int oy) {
+                shiftMtb.shift(mtb2, ox, oy);
+                shiftExcl.shift(excl2, ox, oy);
                 shiftMtb.bitwiseXor(mtb1);
                 shiftMtb.bitwiseAnd(excl1);
                 shiftMtb.bitwiseAnd(shiftExcl);
-                size_t err = shiftMtb.count();
+                return shiftMtb.count();
+            };
+        }
+        int curDx = dx, curDy = dy;
+        for (int i = -1; i <= 1; ++i) {
+            for (int j = -1; j <= 1; ++j) {
+                size_t err = error(curDx + i, curDy + j);
                 if (err < minError) {
                     dx = curDx + i;
                     dy = curDy + j;
@@ -213,21 +482,114 @@ size_t Image::alignWith(const Image & r) {
                 }
             }
         }
-        dx <<= 1;
-        dy <<= 1;
+        if (s > 0) {
+            dx <<= 1;
+            dy <<= 1;
+        } else {
+            dx *= alignPeriodX;
+            dy *= alignPeriodY;
+        }
         totalError += minError;
     }
     return totalError;
 }
 
 
-void Image::preScale() {
-    size_t curWidth = width;
-    size_t curHeight = height;
-    Array2D<uint16_t> * r2 = this;
+// Exposures of neighbouring images, on the same scale, that differ by more than this fraction are moving
+static const double ghostThreshold = 0.25;
+
+static inline bool isMoving(double e1, double e2) {
+    return std::abs(e1 - e2) > ghostThreshold * std::max(e1, e2);
+}
+
 
+size_t Image::markMotion(const Image & r, Array2D<uint8_t> & cells, int level) const {
+    const Array2D<uint16_t> & coarse1 = scaled[level], & coarse2 = r.scaled[level];
+    const Array2D<uint16_t> & fine1 = scaled[0], & fine2 = r.scaled[0];
+    const int cellWidth = alignPeriodX << level, cellHeight = alignPeriodY << level;
+    const int cellsWidth = cells.getWidth(), cellsHeight = cells.getHeight();
+    // Offset of the darker image in each level, both images are displaced by whole periods
+    const int ox = (dx - r.dx) / alignPeriodX, oy = (dy - r.dy) / alignPeriodY;
+    const int cox = std::lround(ox / double(1 << level)), coy = std::lround(oy / double(1 << level));
+    // The darker image is too noisy below this
+    const uint16_t minValue = r.satThreshold / 64;
+    // Whether any pixel of a CFA period is saturated, in pyramid coordinates
+    auto periodSaturated = [] (const Image & img, int x, int y) {
+        for (int row = 0; row < img.alignPeriodY; ++row) {
+            const uint16_t * src = &img.data[(y * img.alignPeriodY + row) * img.width + x * img.alignPeriodX];
+            for (int col = 0; col < img.alignPeriodX; ++col) {
+                if (src[col] >= img.satThreshold) return true;
+            }
+        }
+        return false;
+    };
+    size_t marked = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:marked)
+    for (int y = 0; y < (int)coarse1.getHeight(); ++y) {
+        int ry = y + coy;
+        int gy = y * cellHeight + dy + cellHeight / 2;
+        if (ry < 0 || ry >= (int)coarse2.getHeight() || gy < 0 || gy >= cellsHeight * cellHeight) continue;
+        for (int x = 0; x < (int)coarse1.getWidth(); ++x) {
+            int rx = x + cox;
+            int gx = x * cellWidth + dx + cellWidth / 2;
+            if (rx < 0 || rx >= (int)coarse2.getWidth() || gx < 0 || gx >= cellsWidth * cellWidth) continue;
+            uint16_t v1 = coarse1(x, y), v2 = coarse2(rx, ry);
+            // The coarse levels are only half aligned, so they just choose the cells to refine
+            if (v1 >= satThreshold || v2 < minValue || !isMoving(response(v1), r.response(v2))) continue;
+            int compared = 0, moving = 0;
+            for (int fy = y << level; fy < (y + 1) << level; ++fy) {
+                int fry = fy + oy;
+                if (fry < 0 || fry >= (int)fine2.getHeight()) continue;
+                for (int fx = x << level; fx < (x + 1) << level; ++fx) {
+                    int frx = fx + ox;
+                    if (frx < 0 || frx >= (int)fine2.getWidth() || fine2(frx, fry) < minValue
+                        || periodSaturated(*this, fx, fy) || periodSaturated(r, frx, fry)) continue;
+                    ++compared;
+                    if (isMoving(response(fine1(fx, fy)), r.response(fine2(frx, fry)))) {
+                        ++moving;
+                    }
+                }
+            }
+            if (moving * 8 > compared && moving >= 4) {
+                // The cells are shared by all the threads
+                uint8_t & cell = cells(gx / cellWidth, gy / cellHeight);
+                #pragma omp atomic write
+                cell = 1;
+                ++marked;
+            }
+        }
+    }
+    return marked;
+}
+
+
+void Image::preScale(int periodX, int periodY) {
+    alignPeriodX = periodX;
+    alignPeriodY = periodY;
     scaled = std::make_unique<Array2D<uint16_t>[]>(scaleSteps);
-    for (int s = 0; s < scaleSteps; ++s) {
+    size_t curWidth = width / periodX;
+    size_t curHeight = height / periodY;
+    scaled[0].resize(curWidth, curHeight);
+    // Sum whole rows first, so that the inner loops run over contiguous pixels
+    std::vector<uint32_t> sums(curWidth);
+    const uint32_t count = periodX * periodY;
+    for (size_t y = 0; y < curHeight; ++y) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int row = 0; row < periodY; ++row) {
+            const uint16_t * src = &data[(y * periodY + row) * width];
+            for (size_t x = 0; x < curWidth; ++x) {
+                for (int col = 0; col < periodX; ++col) {
+                    sums[x] += src[x * periodX + col];
+                }
+            }
+        }
+        for (size_t x = 0; x < curWidth; ++x) {
+            scaled[0](x, y) = sums[x] / count;
+        }
+    }
+
+    Array2D<uint16_t> * r2 = &scaled[0];
+    for (int s = 1; s < scaleSteps; ++s) {
         scaled[s].resize(curWidth >>= 1, curHeight >>= 1);
         for (size_t y = 0, prevY = 0; y < curHeight; ++y, prevY += 2) {
             for (size_t x = 0, prevX = 0; x < curWidth; ++x, prevX += 2) {
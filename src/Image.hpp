@@ -26,6 +26,7 @@
 #include <memory>
 
 #include <QString>
+#include <QDataStream>
 
 #include <interpolation.h>
 
@@ -40,12 +41,18 @@ class Image : public Array2D<uint16_t> {
 public:
     static const int scaleSteps = 6;
 
-    Image() : Array2D<uint16_t>() {}
+    Image() : Array2D<uint16_t>(), alignPeriodX(2), alignPeriodY(2) {}
     Image(uint16_t * rawImage, const RawParameters & params, const QString& _filename) :
-        filename(_filename)
+        filename(_filename), alignPeriodX(2), alignPeriodY(2)
     {
         buildImage(rawImage, params);
     }
+    /// Like halfSize, but binned while the raw data is read, without a full size copy
+    Image(uint16_t * rawImage, const RawParameters & params, const QString& _filename, int periodX, int periodY) :
+        filename(_filename), alignPeriodX(2), alignPeriodY(2)
+    {
+        buildHalfImage(rawImage, params, periodX, periodY);
+    }
     Image(const Image & copy) = delete;
     Image & operator=(const Image & copy) = delete;
     Image(Image && move) {
@@ -75,16 +82,35 @@ public:
         return isSaturated(getMaxAround(x, y));
     }
     double getRelativeExposure() const;
-    size_t alignWith(const Image & r);
-    void preScale();
+    /// Mean raw value, that sorts the images of a stack
+    double getBrightness() const {
+        return brightness;
+    }
+    /// If sampled, the finest levels are only compared in the tiles with the most edges
+    size_t alignWith(const Image & r, bool sampled = false);
+    /// Builds the alignment pyramid. Its first level averages each CFA period of periodX x periodY
+    /// pixels, so that images are aligned on luminance, by whole periods, whatever their pattern.
+    void preScale(int periodX = 2, int periodY = 2);
     void releaseAlignData() {
         scaled.reset();
     }
+    bool hasAlignData() const {
+        return scaled.get() != nullptr;
+    }
+    /// Marks the cells, of the alignment pyramid level in stack coordinates, where this image and
+    /// the next darker one disagree once their exposures are matched. Needs both pyramids and responses.
+    size_t markMotion(const Image & r, Array2D<uint8_t> & cells, int level) const;
     void computeResponseFunction(const Image & nextImage);
     bool operator<(const Image & r) {
         return brightness > r.brightness;
     }
     void setSaturationThreshold(uint16_t sat);
+    /// Half size copy that keeps the CFA layout, given its period in columns and rows
+    Image halfSize(int periodX, int periodY) const;
+    /// Displacement and response function, as computed by align and computeResponseFunction
+    void writeAnalysis(QDataStream & out) const;
+    /// Only validates the data if apply is false
+    bool readAnalysis(QDataStream & in, bool apply);
     uint16_t getMax() const
     {
         return max;
@@ -104,6 +130,7 @@ private:
     QString filename;
 
     std::unique_ptr<Array2D<uint16_t>[]> scaled;
+    int alignPeriodX, alignPeriodY;
     uint16_t satThreshold, max;
     double brightness;
     ResponseFunction response;
@@ -111,6 +138,7 @@ private:
 
     void subtractBlack(const RawParameters & params);
     void buildImage(uint16_t * rawImage, const RawParameters & params);
+    void buildHalfImage(uint16_t * rawImage, const RawParameters & params, int periodX, int periodY);
 };
 
 } // namespace hdrmerge
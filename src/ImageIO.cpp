@@ -22,25 +22,52 @@
 
 #include <cstdlib>
 #include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <thread>
 #include <QImage>
+#include <QTransform>
 #include <QString>
 #include <QRegularExpression>
 #include <QFileInfo>
 #include <libraw.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "ImageIO.hpp"
 #include "DngFloatWriter.hpp"
+#include "DngReader.hpp"
+#include "LibRawPool.hpp"
+#include "MaskFile.hpp"
+#include "Sidecar.hpp"
 #include "Log.hpp"
 
 namespace hdrmerge {
 
-Image ImageIO::loadRawImage(const QString& filename, RawParameters & rawParameters, int shot_select) {
-    auto rawProcessor = std::make_unique<LibRaw>();
+Image ImageIO::loadRawImage(const QString& filename, RawParameters & rawParameters, int shot_select, bool halfSize) {
+    auto rawProcessor = LibRawPool::acquire();
     auto & d = rawProcessor->imgdata;
 #if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 21, 0)
     d.rawparams.shot_select = shot_select;
 #else
     d.params.shot_select = shot_select;
 #endif
+    std::vector<uint16_t> dngRaw;
+    DngReader::Levels dngLevels;
+    auto decodeDng = [&] () {
+        // LibRaw decodes DNG tiles serially, decode them in parallel when the format allows it
+        if (!d.idata.dng_version || shot_select != 0) return false;
+        dngRaw.resize((size_t)d.sizes.raw_width * d.sizes.raw_height);
+        return DngReader::decode(filename, d.sizes.raw_width, d.sizes.raw_height, dngRaw.data(), &dngLevels);
+    };
+    // LibRaw's half_size only applies when it interpolates, the raw data is binned here instead
+    auto makeImage = [&] (uint16_t * rawImage) {
+        if (halfSize) {
+            return Image(rawImage, rawParameters, filename, rawParameters.FC.getColumns(), rawParameters.FC.getRows());
+        }
+        return Image(rawImage, rawParameters, filename);
+    };
     if (rawProcessor->open_file(rawParameters.fileName.toLocal8Bit().constData()) == LIBRAW_SUCCESS) {
         libraw_decoder_info_t decoder_info;
         rawProcessor->get_decoder_info(&decoder_info);
@@ -50,10 +77,16 @@ Image ImageIO::loadRawImage(const QString& filename, RawParameters & rawParamete
         } else if (!decoder_info.decoder_flags & LIBRAW_DECODER_FLATFIELD) {
             Log::msg(Log::DEBUG, "LibRaw decoder is not flatfield (", ios::hex, decoder_info.decoder_flags, ").");
 #endif
+        } else if (decodeDng()) {
+            // LibRaw completes the levels when it unpacks, take them from the file instead
+            rawParameters.fromLibRaw(*(rawProcessor.get()));
+            rawParameters.setLevels(dngLevels.white, dngLevels.blackRows, dngLevels.blackCols, dngLevels.black);
+            return makeImage(dngRaw.data());
         } else if (rawProcessor->unpack() != LIBRAW_SUCCESS) {
             Log::msg(Log::DEBUG, "LibRaw::unpack() failed.");
         } else {
             rawParameters.fromLibRaw(*(rawProcessor.get()));
+            return makeImage(d.rawdata.raw_image);
         }
     } else {
         Log::msg(Log::DEBUG, "LibRaw::open_file(", rawParameters.fileName, ") failed.");
@@ -62,7 +95,7 @@ Image ImageIO::loadRawImage(const QString& filename, RawParameters & rawParamete
 }
 
 int ImageIO::getFrameCount(RawParameters & rawParameters) {
-    auto rawProcessor = std::make_unique<LibRaw>();
+    auto rawProcessor = LibRawPool::acquire();
     auto & d = rawProcessor->imgdata;
     if (rawProcessor->open_file(rawParameters.fileName.toLocal8Bit().constData()) == LIBRAW_SUCCESS) {
         Log::msg(Log::DEBUG, "Number of frames : ", d.idata.raw_count);
@@ -73,8 +106,66 @@ int ImageIO::getFrameCount(RawParameters & rawParameters) {
 
 }
 
+bool ImageIO::readExposure(RawParameters & rawParameters) {
+    auto rawProcessor = LibRawPool::acquire();
+    auto & d = rawProcessor->imgdata;
+    if (rawProcessor->open_file(rawParameters.fileName.toLocal8Bit().constData()) == LIBRAW_SUCCESS) {
+        rawParameters.isoSpeed = d.other.iso_speed;
+        rawParameters.shutter = d.other.shutter;
+        rawParameters.aperture = d.other.aperture > 0.f ? d.other.aperture : 8.f;
+        return true;
+    }
+    return false;
+}
+
+std::list<LoadOptions> ImageIO::getBracketedSets(const LoadOptions & options) {
+    std::list<LoadOptions> result;
+    std::list<std::pair<QDateInterval, QString>> dateNames;
+    for (const QString & name : options.fileNames) {
+        QDateInterval interval = getImageCreationInterval(name);
+        if (interval.start.isValid()) {
+            dateNames.emplace_back(interval, name);
+        } else {
+            // We cannot get time information, process it alone
+            result.push_back(options);
+            result.back().fileNames.clear();
+            result.back().fileNames.push_back(name);
+        }
+    }
+    dateNames.sort();
+    QDateInterval lastInterval;
+    for (auto & dateName : dateNames) {
+        if (lastInterval.start.isNull() || lastInterval.difference(dateName.first) > options.batchGap) {
+            result.push_back(options);
+            result.back().fileNames.clear();
+        }
+        result.back().fileNames.push_back(dateName.second);
+        lastInterval = dateName.first;
+    }
+    return result;
+}
+
+
+void ImageIO::swap(ImageIO & other) {
+    stack.swap(other.stack);
+    rawParameters.swap(other.rawParameters);
+    fullStack.swap(other.fullStack);
+    fullParameters.swap(other.fullParameters);
+    std::swap(pendingFullResolution, other.pendingFullResolution);
+    std::swap(loadOptions, other.loadOptions);
+    std::swap(composeCache, other.composeCache);
+    std::swap(composeStats, other.composeStats);
+    std::swap(unsavedArea, other.unsavedArea);
+    std::swap(savedMax, other.savedMax);
+    std::swap(precomposed, other.precomposed);
+    std::swap(tileCache, other.tileCache);
+    std::swap(streaming, other.streaming);
+    std::swap(streamingParams, other.streamingParams);
+}
+
+
 ImageIO::QDateInterval ImageIO::getImageCreationInterval(const QString & fileName) {
-    auto rawProcessor = std::make_unique<LibRaw>();
+    auto rawProcessor = LibRawPool::acquire();
     QDateInterval result;
     if (rawProcessor->open_file(fileName.toLocal8Bit().constData()) == LIBRAW_SUCCESS) {
         result.end = QDateTime::fromSecsSinceEpoch(rawProcessor->imgdata.other.timestamp);
@@ -84,155 +175,584 @@ ImageIO::QDateInterval ImageIO::getImageCreationInterval(const QString & fileNam
 }
 
 
-int ImageIO::load(const LoadOptions & options, ProgressIndicator & progress) {
+int ImageIO::loadImages(const LoadOptions & options, ImageStack & s, std::vector<std::unique_ptr<RawParameters>> & params,
+                        bool halfSize, ProgressIndicator & progress) {
     int numImages = options.fileNames.size();
     int step;
     int p = 0;
     int error = 0, failedImage = 0;
-    stack.clear();
-    rawParameters.clear();
-    {
-        Timer t("Load files");
-        if(numImages == 1) { // check for multiframe raw files
-            const QString name = options.fileNames[0];
-            auto params = std::make_unique<RawParameters>(name);
-            int frameCount = getFrameCount(*params);
-            step = 100 / (frameCount + 1);
-            p = 0;
-            if(frameCount > 0 && frameCount <= 4) {
-                // framecount == 1 => create a dng from a single file with a single frame
-                // framecount == 2 => create a merged dng from a fuji exr file
-                // framecount == 3 => create a merged dng from a pentax hdr file
-                for (int i = 0; i < frameCount; ++i) {
-                    progress.advance(p, "Loading %1", name.toLocal8Bit().constData());
-                    p += step;
-                    auto params = std::make_unique<RawParameters>(name);
-
-                    Image image = loadRawImage(name, *params, i);
-                    if (!image.good()) {
-                        error = 1;
-                        failedImage = i;
-                        break;
-                    } else if (stack.size() && !params->isSameFormat(*rawParameters.front())) {
-                        error = 2;
-                        failedImage = i;
-                        break;
-                    } else {
-                        int pos = stack.addImage(std::move(image));
-                        rawParameters.emplace_back(std::move(params));
-                        for (int j = rawParameters.size() - 1; j > pos; --j)
-                            rawParameters[j - 1].swap(rawParameters[j]);
-                    }
-                }
-            }
-        } else {
-            step = 100 / (numImages + 1);
-            for (int i = 0; i < numImages; ++i) {
-                const QString name = options.fileNames[i];
+    if(numImages == 1) { // check for multiframe raw files
+        const QString name = options.fileNames[0];
+        RawParameters fileParams(name);
+        int frameCount = getFrameCount(fileParams);
+        step = 100 / (frameCount + 1);
+        p = 0;
+        if(frameCount > 0 && frameCount <= 4) {
+            // framecount == 1 => create a dng from a single file with a single frame
+            // framecount == 2 => create a merged dng from a fuji exr file
+            // framecount == 3 => create a merged dng from a pentax hdr file
+            for (int i = 0; i < frameCount; ++i) {
                 progress.advance(p, "Loading %1", name.toLocal8Bit().constData());
                 p += step;
-                auto params = std::make_unique<RawParameters>(name);
+                auto frameParams = std::make_unique<RawParameters>(name);
 
-                Image image = loadRawImage(name, *params);
+                Image image = loadRawImage(name, *frameParams, i, halfSize);
                 if (!image.good()) {
                     error = 1;
                     failedImage = i;
                     break;
-                } else if (stack.size() && !params->isSameFormat(*rawParameters.front())) {
+                } else if (s.size() && !frameParams->isSameFormat(*params.front())) {
                     error = 2;
                     failedImage = i;
                     break;
                 } else {
-                    int pos = stack.addImage(std::move(image));
-                    rawParameters.emplace_back(std::move(params));
-                    for (int j = rawParameters.size() - 1; j > pos; --j)
-                        rawParameters[j - 1].swap(rawParameters[j]);
+                    int pos = s.addImage(std::move(image));
+                    params.emplace_back(std::move(frameParams));
+                    for (int j = params.size() - 1; j > pos; --j)
+                        params[j - 1].swap(params[j]);
                 }
             }
         }
+    } else {
+        step = 100 / (numImages + 1);
+        for (int i = 0; i < numImages; ++i) {
+            const QString name = options.fileNames[i];
+            progress.advance(p, "Loading %1", name.toLocal8Bit().constData());
+            p += step;
+            auto imageParams = std::make_unique<RawParameters>(name);
+
+            Image image = loadRawImage(name, *imageParams, 0, halfSize);
+            if (!image.good()) {
+                error = 1;
+                failedImage = i;
+                break;
+            } else if (s.size() && !imageParams->isSameFormat(*params.front())) {
+                error = 2;
+                failedImage = i;
+                break;
+            } else {
+                int pos = s.addImage(std::move(image));
+                params.emplace_back(std::move(imageParams));
+                for (int j = params.size() - 1; j > pos; --j)
+                    params[j - 1].swap(params[j]);
+            }
+        }
     }
     if (error) {
-        stack.clear();
-        rawParameters.clear();
+        s.clear();
+        params.clear();
         return (failedImage << 1) + error - 1;
     }
-
     progress.advance(p, "Processing stack");
+    return numImages << 1;
+}
+
 
-    RawParameters & params = *rawParameters.front();
-    stack.setFlip(params.flip);
+int ImageIO::load(const LoadOptions & options, ProgressIndicator & progress) {
+    int numImages = options.fileNames.size();
+    streaming.start(0, 0);
+    stack.clear();
+    fullStack.clear();
+    rawParameters.clear();
+    fullParameters.clear();
+    pendingFullResolution = false;
+    composeCache = ImageStack::ComposeCache();
+    composeStats = ImageStack::ComposeStats();
+    unsavedArea = QRect();
+    savedMax = 0.0f;
+    precomposed = Precomposed();
+    tileCache = DngFloatWriter::TileCache();
+    // Half size stacks are binned as the raw data is read. A quick look keeps only binned stacks,
+    // for halfSizeFirst processFullResolution reads the full resolution images again.
+    bool halfSizeFirst = options.halfSizeFirst && !options.quickLook;
+    bool halfSize = halfSizeFirst || options.quickLook > 1;
+    {
+        Timer t("Load files");
+        int result = loadImages(options, stack, rawParameters, halfSize, progress);
+        if (result < numImages << 1 || stack.size() == 0) {
+            return result;
+        }
+    }
+
+    loadOptions = options;
+    pendingFullResolution = halfSizeFirst;
+    // With a half size stack, the full resolution one gets the analysis of the sidecar
+    if (!halfSize && readSidecar(stack, *rawParameters.front(), options)) {
+        progress.advance(100, "Done loading!");
+        return numImages << 1;
+    }
+
+    if (options.quickLook > 2) {
+        // Only the binned stack is kept, there is no full resolution output
+        const CFAPattern & FC = rawParameters.front()->FC;
+        for (int scale = 2; scale < options.quickLook; scale *= 2) {
+            ImageStack larger;
+            larger.swap(stack);
+            for (size_t i = 0; i < larger.size(); ++i) {
+                stack.addImage(larger.getImage(i).halfSize(FC.getColumns(), FC.getRows()));
+            }
+        }
+    }
+    processStack(stack, *rawParameters.front(), options);
+    progress.advance(100, "Done loading!");
+    return numImages << 1;
+}
+
+
+bool ImageIO::readSidecar(ImageStack & s, RawParameters & params, const LoadOptions & options) {
+    if (!options.useSidecar || options.quickLook) return false;
+    QString sidecar = sidecarFileName(options);
+    if (!Sidecar::read(sidecar, options, s)) return false;
+    Log::progress("Reusing the analysis in ", sidecar);
+    s.setFlip(params.flip);
+    adjustWhiteLevel(params, options);
+    return true;
+}
+
+
+QString ImageIO::sidecarFileName(const LoadOptions & options) const {
+    // Not next to the output, which the GUI may save under any name, but where the default output would go
+    QString output = options.outputFileName.isEmpty() ? buildOutputFileName() : replaceArguments(options.outputFileName, "");
+    return Sidecar::fileNameFor(output);
+}
+
+
+int ImageIO::loadStreaming(const LoadOptions & options, ProgressIndicator & progress) {
+    int numImages = options.fileNames.size();
+    stack.clear();
+    fullStack.clear();
+    rawParameters.clear();
+    fullParameters.clear();
+    pendingFullResolution = false;
+    composeCache = ImageStack::ComposeCache();
+    composeStats = ImageStack::ComposeStats();
+    unsavedArea = QRect();
+    savedMax = 0.0f;
+    precomposed = Precomposed();
+    tileCache = DngFloatWriter::TileCache();
+    loadOptions = options;
+
+    // Sort the frames by exposure with their metadata, from the brightest to the darkest
+    std::vector<int> fileIndex;
+    std::vector<double> exposure;
+    bool metadata = true;
+    for (int i = 0; i < numImages; ++i) {
+        auto params = std::make_unique<RawParameters>(options.fileNames[i]);
+        if (!readExposure(*params)) {
+            rawParameters.clear();
+            return i << 1;
+        }
+        metadata = metadata && params->isoSpeed > 0.0f && params->shutter > 0.0f;
+        exposure.push_back(params->logExp());
+        rawParameters.emplace_back(std::move(params));
+        fileIndex.push_back(i);
+    }
+    if (!metadata) {
+        // Without it, measure their brightness as ImageStack does, on half size images
+        Log::progress("Some images have no exposure data, measuring their brightness");
+        for (int i = 0; i < numImages; ++i) {
+            RawParameters probe(options.fileNames[i]);
+            Image image = loadRawImage(options.fileNames[i], probe, 0, true);
+            if (!image.good()) {
+                rawParameters.clear();
+                return i << 1;
+            }
+            exposure[i] = image.getBrightness();
+        }
+    }
+    std::stable_sort(fileIndex.begin(), fileIndex.end(), [&] (int a, int b) {
+        return exposure[a] > exposure[b];
+    });
+    std::vector<std::unique_ptr<RawParameters>> sorted;
+    for (int i : fileIndex) {
+        sorted.emplace_back(std::move(rawParameters[i]));
+    }
+    rawParameters.swap(sorted);
+
+    int step = 100 / (2 * numImages + 1), p = 0;
+    auto loadFrame = [&] (int i, Image & image) {
+        progress.advance(p, "Loading %1", rawParameters[i]->fileName.toLocal8Bit().constData());
+        p += step;
+        image = loadRawImage(rawParameters[i]->fileName, *rawParameters[i]);
+        if (!image.good()) {
+            return 1;
+        } else if (i > 0 && !rawParameters[i]->isSameFormat(*rawParameters.front())) {
+            return 2;
+        }
+        return 0;
+    };
+    auto failure = [&] (int i, int error) {
+        streaming.start(0, 0);
+        rawParameters.clear();
+        return (fileIndex[i] << 1) + error - 1;
+    };
+
+    // The saturation level comes from the brightest frame
+    Image image;
+    int error = loadFrame(0, image);
+    if (error) return failure(0, error);
+    adjustWhiteLevel(*rawParameters.front(), options);
+    RawParameters & brightest = *rawParameters.front();
+    bool align = options.align;
+    if (options.deghost || !options.maskFileName.isEmpty()) {
+        std::cerr << "Deghosting and mask files need the whole stack, they are not used in streaming mode." << std::endl;
+    }
+    {
+        ImageStack probe;
+        probe.addImage(std::move(image));
+        probe.calculateSaturationLevel(brightest, options.useCustomWl);
+        streaming.start(numImages, probe.getSaturationThreshold());
+    }
+
+    for (int i = numImages - 1; i >= 0; --i) {
+        error = loadFrame(i, image);
+        if (error) return failure(i, error);
+        if (i == numImages - 1) {
+            streamingParams = *rawParameters.back();
+            streamingParams.adjustWhite(image);
+        }
+        streaming.analyze(i, std::move(image), align, options.sampledAlign, brightest.FC);
+    }
+    streaming.finishAnalysis(align && options.crop);
+    streamingParams.width = streaming.getWidth();
+    streamingParams.height = streaming.getHeight();
+    progress.advance(100, "Done loading!");
+    return numImages << 1;
+}
+
+
+void ImageIO::saveStreaming(const SaveOptions & options, ProgressIndicator & progress) {
+    Log::msg(2, "Writing ", options.fileName, ", ", options.bps, "-bit, ", streaming.getWidth(), 'x', streaming.getHeight(), ", streaming");
+    if (!options.variants.empty() || !options.roi.isNull() || options.proxy || options.saveMask) {
+        std::cerr << "Variants, regions, proxies and masks are not supported when streaming." << std::endl;
+    }
+    size_t numImages = rawParameters.size();
+    int step = 66 / numImages, p = 0;
+    streaming.beginCompose(streamingParams, options.featherRadius);
+    for (size_t i = 0; i < numImages; ++i) {
+        progress.advance(p, "Blending %1", rawParameters[i]->fileName.toLocal8Bit().constData());
+        p += step;
+        streaming.compose(loadRawImage(rawParameters[i]->fileName, *rawParameters[i]));
+    }
+    Array2D<float> composedImage = streaming.finishCompose();
+
+    progress.advance(66, "Rendering preview");
+    QImage preview = renderPreview(composedImage, streamingParams, streaming.getMaxExposure(), options.previewSize <= 1);
+
+    progress.advance(80, "Writing output");
+    DngFloatWriter writer;
+    writer.setBitsPerSample(options.bps);
+    writer.setPreviewWidth((options.previewSize * streamingParams.width) / 2);
+    writer.setPreview(preview);
+    writer.write(composedImage, streamingParams, options.fileName);
+    progress.advance(100, "Done writing!");
+    streaming.start(0, 0);
+}
+
+
+void ImageIO::adjustWhiteLevel(RawParameters & params, const LoadOptions & options) {
     if(options.useCustomWl)
         // Use custom white level, but only if it's not greater than the value provided by libraw
         params.max = std::min(params.max, options.customWl);
-    stack.calculateSaturationLevel(params, options.useCustomWl);
-    if (options.align && params.canAlign()) {
-        stack.align();
+}
+
+
+void ImageIO::processStack(ImageStack & s, RawParameters & params, const LoadOptions & options) {
+    s.setFlip(params.flip);
+    adjustWhiteLevel(params, options);
+    s.calculateSaturationLevel(params, options.useCustomWl);
+    if (options.align) {
+        s.align(params.FC.getColumns(), params.FC.getRows(), options.sampledAlign, options.deghost);
         if (options.crop) {
-            stack.crop();
+            s.crop();
+        }
+    }
+    s.computeResponseFunctions();
+    s.generateMask();
+    if (options.deghost) {
+        s.deghost(params.FC.getColumns(), params.FC.getRows());
+    }
+    // A half size stack keeps its generated mask, the full one gets the mask file
+    bool halfSize = &s == &stack && hasPendingFullResolution();
+    if (!options.maskFileName.isEmpty() && !options.quickLook && !halfSize) {
+        Array2D<uint8_t> mask;
+        if (!MaskFile::read(options.maskFileName, s.size(), mask) || !s.setMask(mask)) {
+            std::cerr << "Cannot use the mask " << options.maskFileName.toLocal8Bit().constData()
+                << ", it does not fit the stack. Using the generated one." << std::endl;
         }
     }
-    stack.computeResponseFunctions();
-    stack.generateMask();
-    progress.advance(100, "Done loading!");
-    return numImages << 1;
 }
 
 
-void ImageIO::save(const SaveOptions & options, ProgressIndicator & progress) {
+void ImageIO::processFullResolution() {
+    if (!hasPendingFullResolution() || fullStack.size() > 0) return;
+    Timer t("Process full resolution stack");
+    // The half size stack and its parameters are in use, the full one gets its own
+    NullProgressIndicator progress;
+    if (loadImages(loadOptions, fullStack, fullParameters, false, progress) < (int)loadOptions.fileNames.size() << 1) {
+        std::cerr << "Could not load the full resolution images again." << std::endl;
+        return;
+    }
+    if (!readSidecar(fullStack, *fullParameters.front(), loadOptions)) {
+        processStack(fullStack, *fullParameters.front(), loadOptions);
+    }
+}
+
+
+bool ImageIO::installFullResolution() {
+    if (!hasPendingFullResolution()) return true;
+    pendingFullResolution = false;
+    if (fullStack.size() == 0) {
+        // A half size stack cannot be saved
+        stack.clear();
+        rawParameters.clear();
+        return false;
+    }
+    // A pixel of the half size stack covers two pixels of the full one, before cropping
+    QPoint halfOrigin = stack.getCropOrigin(), fullOrigin = fullStack.getCropOrigin();
+    fullStack.getMask().replay(stack.getMask(), 2, 2 * halfOrigin.x() - fullOrigin.x(), 2 * halfOrigin.y() - fullOrigin.y());
+    stack.swap(fullStack);
+    fullStack.clear();
+    rawParameters.swap(fullParameters);
+    fullParameters.clear();
+    composeCache = ImageStack::ComposeCache();
+    composeStats = ImageStack::ComposeStats();
+    unsavedArea = QRect();
+    savedMax = 0.0f;
+    precomposed = Precomposed();
+    tileCache = DngFloatWriter::TileCache();
+    return true;
+}
+
+
+bool ImageIO::save(const SaveOptions & options, ProgressIndicator & progress) {
+    if (streaming.size() > 0) {
+        saveStreaming(options, progress);
+        return true;
+    }
     std::string cropped = stack.isCropped() ? " cropped" : "";
     Log::msg(2, "Writing ", options.fileName, ", ", options.bps, "-bit, ", stack.getWidth(), 'x', stack.getHeight(), cropped);
+    for (const SaveVariant & variant : options.variants) {
+        Log::msg(2, "Writing ", variant.fileName, ", ", variant.bps, "-bit, radius ", variant.featherRadius);
+    }
 
     progress.advance(0, "Rendering image");
-    RawParameters params = *rawParameters.back();
-    params.width = stack.getWidth();
-    params.height = stack.getHeight();
-    params.adjustWhite(stack.getImage(stack.size() - 1));
-    Array2D<float> composedImage = stack.compose(params, options.featherRadius);
+    RawParameters params = getOutputParameters();
+    // One composed image per feather radius, shared by all the outputs that use it
+    std::map<int, Array2D<float>> composed;
+    QImage preview;
+    QRect changed;
+    bool useTileCache = useSessionCache;
+    bool proxy = options.proxy && (params.FC.getFilters() == 9 || params.FC.getRows() == 2);
+    if (options.proxy && !proxy) {
+        std::cerr << "Proxies are not supported for this CFA pattern, writing a full size image." << std::endl;
+    }
+    if (proxy) {
+        // Bayer sensors keep their pattern at half size, X-Trans blocks of 3x3 pixels become RGGB pixels
+        int factor = 2;
+        CFAPattern proxyFC = params.FC;
+        if (params.FC.getFilters() == 9) {
+            factor = 3;
+            proxyFC.setPattern(0x94949494, nullptr);
+        }
+        if (!options.roi.isNull()) {
+            Log::msg(2, "The region of interest is ignored for proxies");
+        }
+        composed[options.featherRadius] = stack.composeProxy(params, options.featherRadius, proxyFC, factor);
+        for (const SaveVariant & variant : options.variants) {
+            if (composed.count(variant.featherRadius) == 0) {
+                composed[variant.featherRadius] = stack.composeProxy(params, variant.featherRadius, proxyFC, factor);
+            }
+        }
+        const Array2D<float> & proxyImage = composed[options.featherRadius];
+        Log::msg(2, "Proxy ", proxyImage.getWidth(), 'x', proxyImage.getHeight());
+        params.width = params.rawWidth = proxyImage.getWidth();
+        params.height = params.rawHeight = proxyImage.getHeight();
+        params.leftMargin = params.topMargin = 0;
+        params.FC = proxyFC;
+        useTileCache = false;
+    } else if (!options.roi.isNull()) {
+        // Start the region at a CFA period, so that the output has the same pattern
+        int periodX = params.FC.getColumns(), periodY = params.FC.getRows();
+        QRect region = options.roi & QRect(0, 0, stack.getWidth(), stack.getHeight());
+        region.setLeft(region.left() - region.left() % periodX);
+        region.setTop(region.top() - region.top() % periodY);
+        if (!options.roi.isValid() || region.isEmpty()) {
+            std::cerr << "The region of interest is outside the image." << std::endl;
+            return false;
+        }
+        Log::msg(2, "Region of interest ", region.width(), 'x', region.height(), " at ", region.left(), ',', region.top());
+        // The output is the region alone, without margins
+        params.width = params.rawWidth = region.width();
+        params.height = params.rawHeight = region.height();
+        params.leftMargin = params.topMargin = 0;
+        composed[options.featherRadius] = stack.composeRegion(params, options.featherRadius, region);
+        for (const SaveVariant & variant : options.variants) {
+            if (composed.count(variant.featherRadius) == 0) {
+                composed[variant.featherRadius] = stack.composeRegion(params, variant.featherRadius, region);
+            }
+        }
+        useTileCache = false;
+    } else if (!useSessionCache) {
+        // Nothing is kept for the next save, so the result is blended straight into the output
+        composed[options.featherRadius] = stack.compose(params, options.featherRadius, &composeStats);
+        stack.getMask().clearDirtyArea();
+        for (const SaveVariant & variant : options.variants) {
+            if (composed.count(variant.featherRadius) == 0) {
+                composed[variant.featherRadius] = stack.compose(params, variant.featherRadius);
+            }
+        }
+    } else {
+        QRect dirty = stack.getMask().getDirtyArea();
+        if (dirty.isEmpty() && precomposed.featherRadius == options.featherRadius) {
+            composed[options.featherRadius] = std::move(precomposed.image);
+            if ((precomposed.previewSize <= 1) == (options.previewSize <= 1)) {
+                preview = precomposed.preview;
+            }
+        } else {
+            composed[options.featherRadius] = stack.compose(params, options.featherRadius, composeCache, dirty);
+            stack.getMask().clearDirtyArea();
+            composeStats = composeCache.stats;
+            unsavedArea |= composeCache.updated;
+        }
+        precomposed = Precomposed();
+        for (const SaveVariant & variant : options.variants) {
+            if (composed.count(variant.featherRadius) == 0) {
+                composed[variant.featherRadius] = stack.compose(params, variant.featherRadius);
+            }
+        }
+        // Tiles are unchanged outside the area recomputed since the last save, unless the scale changed
+        changed = QRect(0, 0, params.rawWidth, params.rawHeight);
+        if (composeCache.max == savedMax) {
+            changed = unsavedArea.translated(params.leftMargin, params.topMargin);
+        }
+        unsavedArea = QRect();
+        savedMax = composeCache.max;
+    }
 
     progress.advance(33, "Rendering preview");
-    QImage preview = renderPreview(composedImage, params, stack.getMaxExposure(), options.previewSize <= 1);
+    // One preview per feather radius, so that each output shows its own image
+    std::map<int, QImage> previews;
+    if (!preview.isNull()) {
+        previews[options.featherRadius] = preview;
+    }
+    for (auto & c : composed) {
+        // LibRaw would not know the pattern of an X-Trans proxy
+        if (previews.count(c.first) == 0) {
+            previews[c.first] = proxy ? renderQuickLook(c.second, params, stack.getMaxExposure())
+                : renderPreview(c.second, params, stack.getMaxExposure(), options.previewSize <= 1);
+        }
+    }
 
     progress.advance(66, "Writing output");
-    DngFloatWriter writer;
-    writer.setBitsPerSample(options.bps);
-    writer.setPreviewWidth((options.previewSize * stack.getWidth()) / 2);
-    writer.setPreview(preview);
-    writer.write(std::move(composedImage), params, options.fileName);
+    Exif::Source exifSource(params.fileName);
+#ifdef _OPENMP
+    // The writers share the processors, instead of each opening a full team
+    int maxThreads = omp_get_max_threads();
+    int writerThreads = std::max(1, maxThreads / (int)(options.variants.size() + 1));
+#endif
+    auto writeOutput = [&] (const QString & fileName, int bps, int featherRadius, bool mainOutput) {
+#ifdef _OPENMP
+        omp_set_num_threads(writerThreads);
+#endif
+        DngFloatWriter writer;
+        writer.setBitsPerSample(bps);
+        writer.setPreviewWidth((options.previewSize * params.width) / 2);
+        writer.setPreview(previews.at(featherRadius));
+        writer.setExifSource(&exifSource);
+        if (useTileCache && mainOutput) {
+            writer.setTileCache(&tileCache, changed);
+        }
+        writer.write(composed.at(featherRadius), params, fileName);
+    };
+    // The tiles of each output are already compressed in parallel, but the rest of
+    // the encoding is serial, so the outputs are written concurrently
+    std::vector<std::thread> writers;
+    for (const SaveVariant & variant : options.variants) {
+        writers.emplace_back(writeOutput, variant.fileName, variant.bps, variant.featherRadius, false);
+    }
+    writeOutput(options.fileName, options.bps, options.featherRadius, true);
+    for (std::thread & writer : writers) {
+        writer.join();
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(maxThreads);
+#endif
     progress.advance(100, "Done writing!");
 
     if (options.saveMask) {
         QString name = replaceArguments(options.maskFileName, options.fileName);
         writeMaskImage(name);
     }
+    if (options.saveSidecar) {
+        Sidecar::write(sidecarFileName(loadOptions), loadOptions, stack);
+    }
+    return true;
+}
+
+
+void ImageIO::precompose(int featherRadius, int previewSize, QRect dirty, const Array2D<uint8_t> & mask) {
+    if (stack.size() == 0) return;
+    Timer t("Precompose");
+    RawParameters params = getOutputParameters();
+    // Release the previous result before composing the next one
+    precomposed = Precomposed();
+    Array2D<float> image = stack.compose(params, featherRadius, composeCache, dirty, &mask);
+    composeStats = composeCache.stats;
+    unsavedArea |= composeCache.updated;
+    precomposed.preview = renderPreview(image, params, stack.getMaxExposure(), previewSize <= 1);
+    precomposed.image = std::move(image);
+    precomposed.featherRadius = featherRadius;
+    precomposed.previewSize = previewSize;
+}
+
+
+bool ImageIO::saveQuickLook(const QString & fileName, int featherRadius) {
+    Timer t("Write quick look");
+    RawParameters params = getOutputParameters();
+    // The binned stack has no margins
+    params.rawWidth = params.width;
+    params.rawHeight = params.height;
+    params.leftMargin = params.topMargin = 0;
+    Array2D<float> composedImage = stack.compose(params, featherRadius, &composeStats);
+    QImage image = renderQuickLook(composedImage, params, stack.getMaxExposure());
+    if (image.isNull() || !image.save(fileName, "JPEG", 85)) {
+        std::cerr << "Could not write " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+RawParameters ImageIO::getOutputParameters() const {
+    RawParameters params = *rawParameters.back();
+    params.width = stack.getWidth();
+    params.height = stack.getHeight();
+    params.adjustWhite(stack.getImage(stack.size() - 1));
+    return params;
 }
 
 
 void ImageIO::writeMaskImage(const QString & maskFile) {
     Log::debug("Saving mask to ", maskFile);
-    EditableMask & mask = stack.getMask();
-    QImage maskImage(mask.getWidth(), mask.getHeight(), QImage::Format_Indexed8);
-    int numColors = stack.size() - 1;
-    for (int c = 0; c < numColors; ++c) {
-        int gray = (256 * c) / numColors;
-        maskImage.setColor(c, qRgb(gray, gray, gray));
-    }
-    maskImage.setColor(numColors, qRgb(255, 255, 255));
-    for (size_t y = 0, pos = 0; y < mask.getHeight(); ++y) {
-        for (size_t x = 0; x < mask.getWidth(); ++x, ++pos) {
-            maskImage.setPixel(x, y, mask[pos]);
-        }
-    }
-    if (!maskImage.save(maskFile)) {
+    if (!MaskFile::write(maskFile, stack.getMask(), stack.size())) {
         Log::progress("Cannot save mask image to ", maskFile);
     }
 }
 
 
-static void prepareRawBuffer(LibRaw & rawProcessor) {
+static void prepareRawBuffer(LibRaw & rawProcessor, const RawParameters & params) {
     rawProcessor.imgdata.progress_flags |= LIBRAW_PROGRESS_LOAD_RAW;
     auto & i = rawProcessor.imgdata;
     auto & r = i.rawdata;
     auto & s = i.sizes;
+    // The merged image may be smaller than the sensor, if only a region was composed
+    s.raw_width = params.rawWidth;
+    s.raw_height = params.rawHeight;
+    s.top_margin = params.topMargin;
+    s.left_margin = params.leftMargin;
+    s.width = params.width;
+    s.height = params.height;
     r.color4_image = nullptr;
     r.color3_image = nullptr;
     size_t numPixels = s.raw_width * (s.raw_height + 7);
@@ -247,7 +767,7 @@ static void prepareRawBuffer(LibRaw & rawProcessor) {
 
 QImage ImageIO::renderPreview(const Array2D<float> & rawData, const RawParameters & params, float expShift, bool halfSize) {
     Timer t("Render preview");
-    auto rawProcessor = std::make_unique<LibRaw>();
+    auto rawProcessor = LibRawPool::acquire();
     auto & d = rawProcessor->imgdata;
     d.params.user_sat = 65535;
     d.params.user_black = 0;
@@ -265,10 +785,7 @@ QImage ImageIO::renderPreview(const Array2D<float> & rawData, const RawParameter
     d.params.half_size = halfSize ? 1 : 0; // much faster, will be used for preview size 'half' or 'none'
     if (rawProcessor->open_file(params.fileName.toLocal8Bit().constData()) == LIBRAW_SUCCESS) {
 //             && rawProcessor.unpack() == LIBRAW_SUCCESS) {
-        prepareRawBuffer(*(rawProcessor.get()));
-        // Assume the other sizes are the same as in the raw parameters
-        d.sizes.width = params.width;
-        d.sizes.height = params.height;
+        prepareRawBuffer(*(rawProcessor.get()), params);
         float scale = d.params.user_sat / (float)(params.max - params.black);
         for (size_t y = 0; y < params.rawHeight; ++y) {
             for (size_t x = 0; x < params.rawWidth; ++x) {
@@ -303,6 +820,59 @@ QImage ImageIO::renderPreview(const Array2D<float> & rawData, const RawParameter
 }
 
 
+QImage ImageIO::renderQuickLook(const Array2D<float> & rawData, const RawParameters & params, float expShift) {
+    Timer t("Render quick look");
+    const int periodX = params.FC.getColumns(), periodY = params.FC.getRows();
+    QImage result(params.width / periodX, params.height / periodY, QImage::Format_RGB32);
+    if (result.isNull()) return result;
+    const float range = params.max - params.black;
+    #pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < result.height(); ++y) {
+        QRgb * scanline = (QRgb *)result.scanLine(y);
+        for (int x = 0; x < result.width(); ++x) {
+            // Average each color of the CFA period, with the white balance of the camera
+            float cam[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            int count[4] = { 0, 0, 0, 0 };
+            for (int py = y * periodY; py < (y + 1) * periodY; ++py) {
+                for (int px = x * periodX; px < (x + 1) * periodX; ++px) {
+                    int c = params.FC(px, py);
+                    cam[c] += (rawData(px + params.leftMargin, py + params.topMargin) - params.blackAt(px, py))
+                        * params.camMul[c];
+                    ++count[c];
+                }
+            }
+            for (int c = 0; c < 4; ++c) {
+                cam[c] = count[c] ? cam[c] / (count[c] * range) : 0.0f;
+            }
+            if (params.colors == 3 && count[3]) {
+                cam[1] = (cam[1] + cam[3]) * 0.5f;
+                cam[3] = 0.0f;
+            }
+            int rgb[3];
+            for (int i = 0; i < 3; ++i) {
+                float v = 0.0f;
+                for (int c = 0; c < 4; ++c) {
+                    v += params.rgbCam[i][c] * cam[c];
+                }
+                // Raise the shadows by expShift, keeping the highlights
+                v = std::max(v, 0.0f);
+                v = expShift * v / (1.0f + (expShift - 1.0f) * v);
+                v = std::min(v, 1.0f);
+                v = v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+                rgb[i] = std::round(v * 255.0f);
+            }
+            scanline[x] = qRgb(rgb[0], rgb[1], rgb[2]);
+        }
+    }
+    switch (params.flip) {
+        case 3: return result.transformed(QTransform().rotate(180));
+        case 5: return result.transformed(QTransform().rotate(-90));
+        case 6: return result.transformed(QTransform().rotate(90));
+        default: return result;
+    }
+}
+
+
 class FileNameManipulator {
 public:
     FileNameManipulator(const std::vector<std::unique_ptr<RawParameters>> & paramList) {
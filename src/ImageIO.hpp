@@ -23,6 +23,7 @@
 #ifndef _IMAGEIO_H_
 #define _IMAGEIO_H_
 
+#include <list>
 #include <vector>
 #include <QImage>
 #include <QDateTime>
@@ -31,15 +32,41 @@
 #include "ProgressIndicator.hpp"
 #include "LoadSaveOptions.hpp"
 #include "RawParameters.hpp"
+#include "DngFloatWriter.hpp"
+#include "StreamingStack.hpp"
 
 namespace hdrmerge {
 
 class ImageIO {
 public:
-    ImageIO() {}
+    ImageIO() : pendingFullResolution(false), useSessionCache(false), savedMax(0.0f) {}
 
     int load(const LoadOptions & options, ProgressIndicator & progress);
-    void save(const SaveOptions & options, ProgressIndicator & progress);
+    /// After a load with halfSizeFirst, whether the full resolution stack is still to be installed
+    bool hasPendingFullResolution() const {
+        return pendingFullResolution;
+    }
+    /// Loads, aligns and masks the full resolution stack, with its own parameters. It can run in
+    /// the background, it does not modify the half size stack or the output parameters.
+    void processFullResolution();
+    /// Replaces the half size stack with the full resolution one, carrying over the mask edits.
+    /// If the full resolution images could not be loaded, the stack is emptied and it returns false.
+    bool installFullResolution();
+    /// Like load, but only analyzes the images one by one, so that save merges them with a
+    /// StreamingStack. The mask cannot be edited.
+    int loadStreaming(const LoadOptions & options, ProgressIndicator & progress);
+    /// Returns false if the options do not fit the stack, and nothing was written
+    bool save(const SaveOptions & options, ProgressIndicator & progress);
+    /// Writes a small tone-mapped JPEG of the merged stack, for culling. No DNG is produced.
+    bool saveQuickLook(const QString & fileName, int featherRadius);
+
+    /// Exchanges the loaded images, their analysis and the save caches, but not the session cache setting
+    void swap(ImageIO & other);
+
+    /// Keep the intermediate results of save, so that saving again after a few edits is faster
+    void enableSessionCache(bool enable) {
+        useSessionCache = enable;
+    }
 
     const ImageStack & getImageStack() const {
         return stack;
@@ -48,12 +75,29 @@ public:
         return stack;
     }
 
+    /// Composes the full size result and renders its preview ahead of a save with this radius and
+    /// preview size, so that the save only has to encode them. dirty is the area of the mask edited
+    /// since the last compose, edits made meanwhile are left for the next call or the save. mask is
+    /// a copy of the stack mask, taken when dirty was, so that it can be edited during the compose.
+    void precompose(int featherRadius, int previewSize, QRect dirty, const Array2D<uint8_t> & mask);
+    /// Of the last full size image saved, empty for proxies, regions and streamed stacks
+    const ImageStack::ComposeStats & getComposeStats() const {
+        return composeStats;
+    }
+
+    /// The parameters of the merged image, as passed to compose
+    RawParameters getOutputParameters() const;
     QString buildOutputFileName() const;
     QString getInputPath() const;
     QString replaceArguments(const QString & pattern, const QString & outFileName) const;
     static int getFrameCount(RawParameters & rawParameters) ;
-    static Image loadRawImage(const QString& filename, RawParameters & rawParameters, int shot_select = 0);
+    /// Reads only the ISO, shutter and aperture of a file
+    static bool readExposure(RawParameters & rawParameters);
+    /// If halfSize, the image is binned as Image::halfSize does, given the CFA period of rawParameters
+    static Image loadRawImage(const QString& filename, RawParameters & rawParameters, int shot_select = 0, bool halfSize = false);
     static QImage renderPreview(const Array2D<float> & rawData, const RawParameters & rawParameters, float expShift, bool halfsize = false);
+    /// One pixel per CFA period, without LibRaw
+    static QImage renderQuickLook(const Array2D<float> & rawData, const RawParameters & rawParameters, float expShift);
 
     struct QDateInterval {
         QDateTime start, end;
@@ -65,12 +109,42 @@ public:
         }
     };
     static QDateInterval getImageCreationInterval(const QString & fileName);
+    /// Groups the files of options into sets taken less than batchGap seconds apart
+    static std::list<LoadOptions> getBracketedSets(const LoadOptions & options);
 
 private:
     ImageStack stack;
     std::vector<std::unique_ptr<RawParameters>> rawParameters;
+    ImageStack fullStack;
+    std::vector<std::unique_ptr<RawParameters>> fullParameters;
+    bool pendingFullResolution;
+    LoadOptions loadOptions;
+    bool useSessionCache;
+    ImageStack::ComposeCache composeCache;
+    ImageStack::ComposeStats composeStats;
+    QRect unsavedArea; ///< Recomposed since the last save, in the frame of the stack
+    float savedMax;    ///< Maximum of the last save, the tiles are rescaled if it changes
+    struct Precomposed {
+        int featherRadius;
+        int previewSize;
+        Array2D<float> image;
+        QImage preview;
+        Precomposed() : featherRadius(-1), previewSize(0) {}
+    } precomposed;
+    DngFloatWriter::TileCache tileCache;
+    StreamingStack streaming;
+    RawParameters streamingParams;
 
+    /// Loads the files of options into s, sorted with params. Returns an error code as load does.
+    int loadImages(const LoadOptions & options, ImageStack & s, std::vector<std::unique_ptr<RawParameters>> & params,
+                   bool halfSize, ProgressIndicator & progress);
+    bool readSidecar(ImageStack & s, RawParameters & params, const LoadOptions & options);
+    /// Where the sidecar of options is read and written, the same whatever the name of the output
+    QString sidecarFileName(const LoadOptions & options) const;
+    void adjustWhiteLevel(RawParameters & params, const LoadOptions & options);
+    void processStack(ImageStack & s, RawParameters & params, const LoadOptions & options);
     void writeMaskImage(const QString & maskFile);
+    void saveStreaming(const SaveOptions & options, ProgressIndicator & progress);
 };
 
 } // namespace hdrmerge
@@ -21,6 +21,7 @@
  */
 
 #include <algorithm>
+#include <cmath>
 
 #include <QVarLengthArray>
 
@@ -28,6 +29,7 @@
 #include "ImageStack.hpp"
 #include "Log.hpp"
 #include "RawParameters.hpp"
+#include "RunLength.hpp"
 
 #ifdef __SSE2__
     #include <x86intrin.h>
@@ -50,6 +52,18 @@ int ImageStack::addImage(Image && i) {
 }
 
 
+void ImageStack::swap(ImageStack & other) {
+    images.swap(other.images);
+    mask.swap(other.mask);
+    std::swap(origMask, other.origMask);
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    std::swap(cropOrigin, other.cropOrigin);
+    std::swap(flip, other.flip);
+    std::swap(satThreshold, other.satThreshold);
+}
+
+
 void ImageStack::calculateSaturationLevel(const RawParameters & params, bool useCustomWl) {
     // Calculate max value of brightest image and assume it is saturated
     Image& brightest = images.front();
@@ -123,25 +137,25 @@ void ImageStack::calculateSaturationLevel(const RawParameters & params, bool use
 }
 
 
-void ImageStack::align() {
+void ImageStack::align(int periodX, int periodY, bool sampled, bool keepAlignData) {
     if (images.size() > 1) {
         Timer t("Align");
         QVarLengthArray<size_t> errors(images.size());
         #pragma omp parallel for schedule(dynamic)
         for (size_t i = 0; i < images.size(); ++i) {
-            images[i].preScale();
+            images[i].preScale(periodX, periodY);
         }
         #pragma omp parallel for schedule(dynamic)
         for (size_t i = 0; i < images.size() - 1; ++i) {
-            errors[i] = images[i].alignWith(images[i + 1]);
+            errors[i] = images[i].alignWith(images[i + 1], sampled);
         }
         for (size_t i = images.size() - 1; i > 0; --i) {
             images[i - 1].displace(images[i].getDeltaX(), images[i].getDeltaY());
             Log::debug("Image ", i - 1, " displaced to (", images[i - 1].getDeltaX(),
                        ", ", images[i - 1].getDeltaY(), ") with error ", errors[i - 1]);
         }
-        for (auto & i : images) {
-            i.releaseAlignData();
+        if (!keepAlignData) {
+            releaseAlignData();
         }
     }
 }
@@ -161,6 +175,7 @@ void ImageStack::crop() {
     for (auto & i : images) {
         i.displace(-dx, -dy);
     }
+    cropOrigin = QPoint(dx, dy);
 }
 
 
@@ -197,6 +212,194 @@ void ImageStack::generateMask() {
 }
 
 
+bool ImageStack::setMask(const Array2D<uint8_t> & newMask) {
+    if (newMask.getWidth() != width || newMask.getHeight() != height) {
+        Log::debug("The mask is ", newMask.getWidth(), 'x', newMask.getHeight(), " but the stack is ", width, 'x', height);
+        return false;
+    }
+    if (width == 0 || height == 0) {
+        return true;
+    }
+    if (*std::max_element(newMask.cbegin(), newMask.cend()) >= images.size()) {
+        Log::debug("The mask has more layers than images");
+        return false;
+    }
+    size_t kept = 0;
+    #pragma omp parallel for reduction(+:kept)
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            uint8_t layer = newMask(x, y);
+            if (images[layer].contains(x, y)) {
+                mask(x, y) = layer;
+            } else {
+                ++kept;
+            }
+        }
+    }
+    if (kept) {
+        Log::debug(kept, " pixels of the mask are outside their layer and keep the generated one");
+    }
+    return true;
+}
+
+
+void ImageStack::deghost(int periodX, int periodY) {
+    if (images.size() < 2) return;
+    Timer t("Deghost");
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (!images[i].hasAlignData()) {
+            images[i].preScale(periodX, periodY);
+        }
+    }
+    // Cells of 8x8 CFA periods, so that only a few of them have to be refined
+    const int level = 3;
+    const int cellWidth = periodX << level, cellHeight = periodY << level;
+    Array2D<uint8_t> cells(width / cellWidth + 1, height / cellHeight + 1);
+    std::fill_n(&cells[0], cells.size(), 0);
+    size_t marked = 0;
+    for (size_t i = 0; i < images.size() - 1; ++i) {
+        marked += images[i].markMotion(images[i + 1], cells, level);
+    }
+    releaseAlignData();
+    if (marked == 0) {
+        Log::debug("No moving areas found");
+        return;
+    }
+
+    // Grow the marked cells by one, to cover the edges of the moving objects
+    const int cw = cells.getWidth(), ch = cells.getHeight();
+    Array2D<uint8_t> grown(cw, ch);
+    #pragma omp parallel for
+    for (int y = 0; y < ch; ++y) {
+        for (int x = 0; x < cw; ++x) {
+            uint8_t m = 0;
+            for (int j = std::max(y - 1, 0); j <= std::min(y + 1, ch - 1); ++j) {
+                for (int i = std::max(x - 1, 0); i <= std::min(x + 1, cw - 1); ++i) {
+                    m |= cells(i, j);
+                }
+            }
+            grown(x, y) = m;
+        }
+    }
+
+    // Each connected area takes the darkest layer that the mask uses in it,
+    // so that it comes from a single image and none of it is saturated
+    int regions = 0;
+    std::vector<QPoint> region, pending;
+    for (int y = 0; y < ch; ++y) {
+        for (int x = 0; x < cw; ++x) {
+            if (grown(x, y) != 1) continue;
+            region.clear();
+            pending.push_back(QPoint(x, y));
+            grown(x, y) = 2;
+            while (!pending.empty()) {
+                QPoint c = pending.back();
+                pending.pop_back();
+                region.push_back(c);
+                const QPoint neighbours[] = { c + QPoint(1, 0), c - QPoint(1, 0), c + QPoint(0, 1), c - QPoint(0, 1) };
+                for (const QPoint & n : neighbours) {
+                    if (n.x() >= 0 && n.x() < cw && n.y() >= 0 && n.y() < ch && grown(n.x(), n.y()) == 1) {
+                        grown(n.x(), n.y()) = 2;
+                        pending.push_back(n);
+                    }
+                }
+            }
+            auto cellRect = [&] (const QPoint & c) {
+                return QRect(c.x() * cellWidth, c.y() * cellHeight, cellWidth, cellHeight)
+                    .intersected(QRect(0, 0, (int)width, (int)height));
+            };
+            int minLayer = images.size(), maxLayer = 0;
+            #pragma omp parallel for reduction(min:minLayer) reduction(max:maxLayer)
+            for (size_t i = 0; i < region.size(); ++i) {
+                QRect r = cellRect(region[i]);
+                for (int py = r.top(); py <= r.bottom(); ++py) {
+                    for (int px = r.left(); px <= r.right(); ++px) {
+                        minLayer = std::min(minLayer, (int)mask(px, py));
+                        maxLayer = std::max(maxLayer, (int)mask(px, py));
+                    }
+                }
+            }
+            if (minLayer == maxLayer) continue;
+            ++regions;
+            const Image & layer = images[maxLayer];
+            #pragma omp parallel for
+            for (size_t i = 0; i < region.size(); ++i) {
+                QRect r = cellRect(region[i]);
+                for (int py = r.top(); py <= r.bottom(); ++py) {
+                    for (int px = r.left(); px <= r.right(); ++px) {
+                        if (layer.contains(px, py)) {
+                            mask(px, py) = maxLayer;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    Log::debug("Deghosted ", regions, " areas from ", marked, " moving cells");
+}
+
+
+static void writeRunLength(QDataStream & out, const Array2D<uint8_t> & a) {
+    std::vector<uint8_t> encoded = encodeRunLength(&a[0], a.size());
+    out << QByteArray((const char *)encoded.data(), encoded.size());
+}
+
+
+static bool readRunLength(QDataStream & in, Array2D<uint8_t> & a) {
+    QByteArray encoded;
+    in >> encoded;
+    return in.status() == QDataStream::Ok &&
+        decodeRunLength((const uint8_t *)encoded.constData(), encoded.size(), &a[0], a.size());
+}
+
+
+void ImageStack::writeAnalysis(QDataStream & out) const {
+    out << (quint32)images.size() << (quint64)width << (quint64)height
+        << (qint32)cropOrigin.x() << (qint32)cropOrigin.y() << satThreshold;
+    for (auto & i : images) {
+        i.writeAnalysis(out);
+    }
+    writeRunLength(out, mask);
+    writeRunLength(out, origMask);
+}
+
+
+bool ImageStack::readAnalysis(QDataStream & in, bool apply) {
+    quint32 n;
+    quint64 w, h;
+    qint32 cx, cy;
+    quint16 sat;
+    in >> n >> w >> h >> cx >> cy >> sat;
+    if (in.status() != QDataStream::Ok || n != images.size() || n == 0
+            || w > images[0].getWidth() || h > images[0].getHeight()) {
+        return false;
+    }
+    for (auto & i : images) {
+        if (apply) {
+            i.setSaturationThreshold(sat);
+        }
+        if (!i.readAnalysis(in, apply)) {
+            return false;
+        }
+    }
+    Array2D<uint8_t> newMask(w, h), newOrigMask(w, h);
+    if (!readRunLength(in, newMask) || !readRunLength(in, newOrigMask)) {
+        return false;
+    }
+    if (apply) {
+        width = w;
+        height = h;
+        cropOrigin = QPoint(cx, cy);
+        satThreshold = sat;
+        mask.reset();
+        static_cast<Array2D<uint8_t> &>(mask) = std::move(newMask);
+        origMask = std::move(newOrigMask);
+    }
+    return true;
+}
+
+
 double ImageStack::value(size_t x, size_t y) const {
     const Image & img = images[mask(x, y)];
     return img.exposureAt(x, y);
@@ -393,8 +596,166 @@ static Array2D<uint8_t> fattenMask(const Array2D<uint8_t> & mask, int radius) {
 }
 #endif
 
-Array2D<float> ImageStack::compose(const RawParameters & params, int featherRadius) const {
-    int imageMax = images.size() - 1;
+double ImageStack::blendAt(const RawParameters & params, size_t x, size_t y, double p) const {
+    p = p < 0.0 ? 0.0 : p;
+    int j = p;
+    const Image * next = j + 1 < (int)images.size() ? &images[j + 1] : nullptr;
+    return blend(params, images[j], next, origMask(x, y), satThreshold, x, y, p);
+}
+
+
+double ImageStack::blend(const RawParameters & params, const Image & image, const Image * next,
+                         int origLayer, uint16_t satThreshold, size_t x, size_t y, double p) {
+    double saturatedRange = params.max - satThreshold;
+    double v, vv;
+    int j = p;
+    if (image.contains(x, y)) {
+        p = p - j;
+        v = image.exposureAt(x, y);
+        // Adjust false highlights
+        if (j < origLayer) { // SaturatedAround
+            v /= params.whiteMultAt(x, y);
+            if(p > 0.0001) {
+                uint16_t rawV = image.getMaxAround(x, y);
+                double k = (rawV - satThreshold) / saturatedRange;
+                if (k > 1.0)
+                    k = 1.0;
+                p += (1.0 - p) * k;
+            }
+        }
+    } else {
+        v = 0.0;
+        p = 1.0;
+    }
+    if (p > 0.0001 && next != nullptr && next->contains(x, y)) {
+        vv = next->exposureAt(x, y);
+        if (j + 1 < origLayer) { // SaturatedAround
+            vv /= params.whiteMultAt(x, y);
+        }
+    } else {
+        vv = 0.0;
+        p = 0.0;
+    }
+    return v - p * (v - vv);
+}
+
+
+Array2D<float> ImageStack::featherMask(const Array2D<uint8_t> & mask, int featherRadius) {
+    BoxBlur map(fattenMask(mask, featherRadius));
+    measureTime("Blur", [&] () {
+        map.blur(featherRadius);
+    });
+    return std::move(map);
+}
+
+
+// Scales a composed image, already in the raw frame of params, to params.max and recovers the black levels
+static void scaleInRawFrame(Array2D<float> & dst, float max, const RawParameters & params) {
+    float mult = (params.max - params.maxBlack) / max;
+    #pragma omp parallel for
+    for (size_t y = 0; y < params.rawHeight; ++y) {
+        for (size_t x = 0; x < params.rawWidth; ++x) {
+            dst(x, y) *= mult;
+            dst(x, y) += params.blackAt(x - params.leftMargin, y - params.topMargin);
+        }
+    }
+}
+
+
+Array2D<float> ImageStack::compose(const RawParameters & params, int featherRadius, ComposeCache & cache, QRect dirty,
+                                   const Array2D<uint8_t> * fromMask) const {
+    const Array2D<uint8_t> & mask = fromMask ? *fromMask : this->mask;
+    QRect whole(0, 0, width, height);
+    // BoxBlur::blur makes three passes with this radius
+    int blurRadius = std::round(featherRadius*0.39);
+    int halo = featherRadius + 3*blurRadius + 1;
+    QRect area = whole;
+    if (cache.featherRadius == featherRadius && cache.map.getWidth() == width && cache.map.getHeight() == height) {
+        // An empty QRect still grows into a valid one when adjusted
+        area = dirty.isEmpty() ? QRect() : dirty.adjusted(-halo, -halo, halo, halo) & whole;
+        // Far enough from the area, the borders of the source do not affect it
+        QRect source = dirty.adjusted(-2*halo, -2*halo, 2*halo, 2*halo) & whole;
+        // The blur needs a few pixels more than its radius, and the SSE loops of fattenMask 16 columns more than its own
+        int minSide = std::max(2*blurRadius + 8, featherRadius + 16);
+        if (area.isEmpty()) {
+            area = QRect();
+        } else if (source == whole || source.width() <= minSide || source.height() <= minSide) {
+            area = whole;
+        } else {
+            Timer t("Feather dirty area");
+            Array2D<uint8_t> subMask(source.width(), source.height());
+            for (int y = 0; y < source.height(); ++y) {
+                std::copy_n(&mask(source.left(), source.top() + y), source.width(), &subMask(0, y));
+            }
+            BoxBlur subMap(fattenMask(subMask, featherRadius));
+            subMap.blur(featherRadius);
+            for (int y = area.top(); y <= area.bottom(); ++y) {
+                std::copy_n(&subMap(area.left() - source.left(), y - source.top()), area.width(), &cache.map(area.left(), y));
+            }
+        }
+    } else {
+        cache.composed.resize(width, height);
+    }
+    if (area == whole) {
+        BoxBlur map(fattenMask(mask, featherRadius));
+        measureTime("Blur", [&] () {
+            map.blur(featherRadius);
+        });
+        cache.map = std::move(map);
+    }
+    cache.featherRadius = featherRadius;
+    cache.updated = area;
+
+    Timer t("Compose");
+    if (!area.isEmpty()) {
+        #pragma omp parallel for schedule(dynamic,16)
+        for (int y = area.top(); y <= area.bottom(); ++y) {
+            for (int x = area.left(); x <= area.right(); ++x) {
+                cache.composed(x, y) = blendAt(params, x, y, cache.map(x, y));
+            }
+        }
+    }
+
+    // The maximum and the statistics are kept per tile, and gathered again only where the result changed
+    const int tileSide = ComposeCache::tileSide;
+    size_t tilesAcross = (width + tileSide - 1) / tileSide;
+    size_t tileCount = tilesAcross * ((height + tileSide - 1) / tileSide);
+    bool allTiles = area == whole || cache.tileStats.size() != tileCount;
+    if (allTiles) {
+        cache.tileStats.assign(tileCount, ComposeStats());
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t t = 0; t < tileCount; ++t) {
+        QRect tile((t % tilesAcross) * tileSide, (t / tilesAcross) * tileSide, tileSide, tileSide);
+        tile &= whole;
+        if (!allTiles && !tile.intersects(area)) continue;
+        ComposeStats tileStats;
+        tileStats.layerPixels.resize(images.size());
+        for (int y = tile.top(); y <= tile.bottom(); ++y) {
+            for (int x = tile.left(); x <= tile.right(); ++x) {
+                float v = cache.composed(x, y);
+                if (v > tileStats.maxValue) {
+                    tileStats.maxValue = v;
+                }
+                addStats(tileStats, x, y, v, mask(x, y));
+            }
+        }
+        tileStats.pixels = tile.width() * tile.height();
+        cache.tileStats[t] = std::move(tileStats);
+    }
+    ComposeStats stats;
+    stats.layerPixels.resize(images.size());
+    for (const ComposeStats & tileStats : cache.tileStats) {
+        stats.add(tileStats);
+    }
+    float max = stats.maxValue;
+    cache.stats = std::move(stats);
+    cache.max = max;
+    return scaleToRaw(cache.composed, max, params);
+}
+
+
+Array2D<float> ImageStack::compose(const RawParameters & params, int featherRadius, ComposeStats * stats) const {
     BoxBlur map(fattenMask(mask, featherRadius));
     measureTime("Blur", [&] () {
         map.blur(featherRadius);
@@ -405,49 +766,125 @@ Array2D<float> ImageStack::compose(const RawParameters & params, int featherRadi
     dst.fillBorders(0.f);
 
     float max = 0.0;
-    double saturatedRange = params.max - satThreshold;
+    ComposeStats total;
+    total.layerPixels.resize(images.size());
     #pragma omp parallel
     {
         float maxthr = 0.0;
+        ComposeStats statsthr;
+        statsthr.layerPixels.resize(images.size());
         #pragma omp for schedule(dynamic,16) nowait
         for (size_t y = 0; y < height; ++y) {
             for (size_t x = 0; x < width; ++x) {
-                double v, vv;
-                double p = map(x,y);
-                p = p < 0.0 ? 0.0 : p;
-                int j = p;
-                if (images[j].contains(x, y)) {
-                    p = p - j;
-                    v = images[j].exposureAt(x, y);
-                    // Adjust false highlights
-                    if (j < origMask(x,y)) { // SaturatedAround
-                        v /= params.whiteMultAt(x, y);
-                        if(p > 0.0001) {
-                            uint16_t rawV = images[j].getMaxAround(x, y);
-                            double k = (rawV - satThreshold) / saturatedRange;
-                            if (k > 1.0)
-                                k = 1.0;
-                            p += (1.0 - p) * k;
-                        }
-                    }
-                } else {
-                    v = 0.0;
-                    p = 1.0;
-                }
-                if (p > 0.0001 && j < imageMax && images[j + 1].contains(x, y)) {
-                    vv = images[j + 1].exposureAt(x, y);
-                    if (j + 1 < origMask(x,y)) { // SaturatedAround
-                        vv /= params.whiteMultAt(x, y);
-                    }
-                } else {
-                    vv = 0.0;
-                    p = 0.0;
-                }
-                v -= p * (v - vv);
-                dst(x, y) = v;
+                float v = dst(x, y) = blendAt(params, x, y, map(x, y));
                 if (v > maxthr) {
                     maxthr = v;
                 }
+                if (stats) {
+                    addStats(statsthr, x, y, v, mask(x, y));
+                }
+            }
+        }
+        #pragma omp critical
+        {
+            if (maxthr > max) {
+                max = maxthr;
+            }
+            total.add(statsthr);
+        }
+    }
+    if (stats) {
+        total.pixels = width * height;
+        total.maxValue = max;
+        *stats = std::move(total);
+    }
+
+    dst.displace(params.leftMargin, params.topMargin);
+    scaleInRawFrame(dst, max, params);
+    return dst;
+}
+
+
+void ImageStack::addStats(ComposeStats & stats, size_t x, size_t y, float v, int layer) const {
+    if (v > 0.0f && (v < stats.minValue || stats.minValue == 0.0f)) {
+        stats.minValue = v;
+    }
+    // The feathered mask dips a little below the mask around its edges, only the edits are counted
+    ++stats.layerPixels[layer];
+    if (layer < origMask(x, y) && images[layer].contains(x, y)) {
+        ++stats.adjustedPixels;
+    }
+    const Image & darkest = images.back();
+    if (darkest.contains(x, y) && darkest.isSaturated(x, y)) {
+        ++stats.clippedPixels;
+    }
+}
+
+
+void ImageStack::ComposeStats::add(const ComposeStats & r) {
+    for (size_t i = 0; i < layerPixels.size() && i < r.layerPixels.size(); ++i) {
+        layerPixels[i] += r.layerPixels[i];
+    }
+    clippedPixels += r.clippedPixels;
+    adjustedPixels += r.adjustedPixels;
+    pixels += r.pixels;
+    maxValue = std::max(maxValue, r.maxValue);
+    if (r.minValue > 0.0f && (r.minValue < minValue || minValue == 0.0f)) {
+        minValue = r.minValue;
+    }
+}
+
+
+Array2D<float> ImageStack::scaleToRaw(const Array2D<float> & composed, float max, const RawParameters & params) {
+    size_t width = composed.getWidth(), height = composed.getHeight();
+    Array2D<float> dst(params.rawWidth, params.rawHeight);
+    dst.displace(-(int)params.leftMargin, -(int)params.topMargin);
+    dst.fillBorders(0.f);
+    #pragma omp parallel for
+    for (size_t y = 0; y < height; ++y) {
+        std::copy_n(&composed(0, y), width, &dst(0, y));
+    }
+
+    dst.displace(params.leftMargin, params.topMargin);
+    scaleInRawFrame(dst, max, params);
+    return dst;
+}
+
+
+Array2D<float> ImageStack::composeRegion(const RawParameters & params, int featherRadius, QRect region) const {
+    QRect whole(0, 0, width, height);
+    region &= whole;
+    if (region.isEmpty()) return Array2D<float>();
+    int blurRadius = std::round(featherRadius*0.39);
+    int halo = featherRadius + 3*blurRadius + 1;
+    // Far enough from the region, the borders of the source do not affect it
+    QRect source = region.adjusted(-2*halo, -2*halo, 2*halo, 2*halo) & whole;
+    if (source.width() <= 2*blurRadius + 16 || source.height() <= 2*blurRadius + 16) {
+        source = whole;
+    }
+    Array2D<uint8_t> subMask(source.width(), source.height());
+    for (int y = 0; y < source.height(); ++y) {
+        std::copy_n(&mask(source.left(), source.top() + y), source.width(), &subMask(0, y));
+    }
+    BoxBlur map(fattenMask(subMask, featherRadius));
+    measureTime("Blur", [&] () {
+        map.blur(featherRadius);
+    });
+
+    Timer t("Compose region");
+    Array2D<float> dst(region.width(), region.height());
+    float max = 0.0;
+    #pragma omp parallel
+    {
+        float maxthr = 0.0;
+        #pragma omp for schedule(dynamic,16) nowait
+        for (int y = 0; y < region.height(); ++y) {
+            for (int x = 0; x < region.width(); ++x) {
+                size_t sx = region.left() + x, sy = region.top() + y;
+                dst(x, y) = blendAt(params, sx, sy, map(sx - source.left(), sy - source.top()));
+                if (dst(x, y) > maxthr) {
+                    maxthr = dst(x, y);
+                }
             }
         }
         #pragma omp critical
@@ -456,17 +893,128 @@ Array2D<float> ImageStack::compose(const RawParameters & params, int featherRadi
         }
     }
 
-    dst.displace(params.leftMargin, params.topMargin);
     // Scale to params.max and recover the black levels
     float mult = (params.max - params.maxBlack) / max;
     #pragma omp parallel for
-    for (size_t y = 0; y < params.rawHeight; ++y) {
-        for (size_t x = 0; x < params.rawWidth; ++x) {
+    for (int y = 0; y < region.height(); ++y) {
+        for (int x = 0; x < region.width(); ++x) {
             dst(x, y) *= mult;
-            dst(x, y) += params.blackAt(x - params.leftMargin, y - params.topMargin);
+            dst(x, y) += params.blackAt(region.left() + x, region.top() + y);
+        }
+    }
+    return dst;
+}
+
+
+Array2D<float> ImageStack::composeProxy(const RawParameters & params, int featherRadius, const CFAPattern & proxyFC, int factor) const {
+    Timer t("Compose proxy");
+    // Keep whole CFA periods of the proxy
+    size_t w = (width / factor) & ~(size_t)1, h = (height / factor) & ~(size_t)1;
+    // Each block takes its darkest layer, as fattenMask would do
+    Array2D<uint8_t> smallMask(w, h);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t sy = 0; sy < h; ++sy) {
+        for (size_t sx = 0; sx < w; ++sx) {
+            uint8_t m = 0;
+            for (size_t y = sy * factor; y < (sy + 1) * factor; ++y) {
+                for (size_t x = sx * factor; x < (sx + 1) * factor; ++x) {
+                    m = std::max(m, mask(x, y));
+                }
+            }
+            smallMask(sx, sy) = m;
+        }
+    }
+    int radius = (featherRadius + factor / 2) / factor;
+    BoxBlur map(fattenMask(smallMask, radius));
+    map.blur(radius);
+
+    Array2D<float> dst(w, h);
+    float max = 0.0;
+    #pragma omp parallel
+    {
+        float maxthr = 0.0;
+        #pragma omp for schedule(dynamic,16) nowait
+        for (size_t sy = 0; sy < h; ++sy) {
+            for (size_t sx = 0; sx < w; ++sx) {
+                int color = proxyFC(sx, sy);
+                double p = map(sx, sy), sum = 0.0;
+                int count = 0;
+                for (size_t y = sy * factor; y < (sy + 1) * factor; ++y) {
+                    for (size_t x = sx * factor; x < (sx + 1) * factor; ++x) {
+                        if (params.FC(x, y) == color) {
+                            sum += blendAt(params, x, y, p);
+                            ++count;
+                        }
+                    }
+                }
+                dst(sx, sy) = count ? sum / count : 0.0;
+                if (dst(sx, sy) > maxthr) {
+                    maxthr = dst(sx, sy);
+                }
+            }
+        }
+        #pragma omp critical
+        if (maxthr > max) {
+            max = maxthr;
         }
     }
 
+    // Scale to params.max and recover the black levels
+    float mult = (params.max - params.maxBlack) / max;
+    #pragma omp parallel for
+    for (size_t y = 0; y < h; ++y) {
+        for (size_t x = 0; x < w; ++x) {
+            dst(x, y) = dst(x, y) * mult + params.cblack[proxyFC(x, y)];
+        }
+    }
+    return dst;
+}
+
+
+Array2D<uint8_t> ImageStack::previewMask(int step) const {
+    size_t w = (width + step - 1) / step, h = (height + step - 1) / step;
+    // Each preview pixel takes the darkest layer of its block, as fattenMask would do
+    Array2D<uint8_t> smallMask(w, h);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t sy = 0; sy < h; ++sy) {
+        for (size_t sx = 0; sx < w; ++sx) {
+            uint8_t m = 0;
+            for (size_t y = sy * step; y < std::min((sy + 1) * step, height); ++y) {
+                for (size_t x = sx * step; x < std::min((sx + 1) * step, width); ++x) {
+                    m = std::max(m, mask(x, y));
+                }
+            }
+            smallMask(sx, sy) = m;
+        }
+    }
+    return smallMask;
+}
+
+
+Array2D<float> ImageStack::composePreview(const RawParameters & params, int featherRadius, int step,
+                                          const Array2D<uint8_t> & smallMask) const {
+    Timer t("Compose preview");
+    // The 2x2 blocks below need at least two rows and columns
+    if (width < 2 || height < 2) {
+        return Array2D<float>();
+    }
+    size_t w = smallMask.getWidth(), h = smallMask.getHeight();
+    int radius = (featherRadius + step / 2) / step;
+    BoxBlur map(fattenMask(smallMask, radius));
+    map.blur(radius);
+
+    // Average a 2x2 block at each sample, so that every CFA color contributes
+    Array2D<float> dst(w, h);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t sy = 0; sy < h; ++sy) {
+        size_t y = std::min(sy * step, height - 2);
+        for (size_t sx = 0; sx < w; ++sx) {
+            size_t x = std::min(sx * step, width - 2);
+            double p = map(sx, sy);
+            dst(sx, sy) = (blendAt(params, x, y, p) + blendAt(params, x + 1, y, p)
+                + blendAt(params, x, y + 1, p) + blendAt(params, x + 1, y + 1, p)) / 4.0;
+        }
+    }
     return dst;
 }
 
@@ -34,21 +34,96 @@
 
 namespace hdrmerge {
 
+class CFAPattern;
+
 class ImageStack {
 public:
     ImageStack() : mask(this), width(0), height(0), flip(0) {}
     void clear() {
         images.clear();
         width = height = 0;
+        cropOrigin = QPoint();
         mask.reset();
     }
+    void swap(ImageStack & other);
 
     int addImage(Image && i);
-    void align();
+    /// Aligns the images by whole CFA periods of periodX x periodY pixels, see Image::alignWith for sampled.
+    /// The alignment pyramids are released afterwards, unless keepAlignData is set for deghost.
+    void align(int periodX = 2, int periodY = 2, bool sampled = false, bool keepAlignData = false);
     void crop();
     void computeResponseFunctions();
     void generateMask();
-    Array2D<float> compose(const RawParameters & md, int featherRadius) const;
+    /// Finds the moving areas, comparing neighbouring images on their alignment pyramids, and fills
+    /// each one with a single layer of the mask. Needs the response functions and the mask.
+    /// The moving cells are found comparing pixels, but whole cells of 8x8 CFA periods change layer.
+    /// Builds the pyramids that align did not keep, and releases them all once compared.
+    void deghost(int periodX = 2, int periodY = 2);
+    /// Replaces the mask built by generateMask, if newMask has the size of the stack and valid layers.
+    /// Pixels outside the image of their layer keep the generated one.
+    bool setMask(const Array2D<uint8_t> & newMask);
+    void releaseAlignData() {
+        for (auto & i : images) {
+            i.releaseAlignData();
+        }
+    }
+    /// Results of calculateSaturationLevel, align, crop, computeResponseFunctions and generateMask,
+    /// with the edits made to the mask
+    void writeAnalysis(QDataStream & out) const;
+    /// Only validates the data if apply is false
+    bool readAnalysis(QDataStream & in, bool apply);
+    /// Quality figures of a composed image, gathered while composing it
+    struct ComposeStats {
+        std::vector<size_t> layerPixels; ///< Pixels of each layer of the mask
+        size_t clippedPixels;  ///< Pixels still saturated in the darkest image
+        size_t adjustedPixels; ///< Pixels edited to a brighter layer, with false highlights adjusted
+        size_t pixels;
+        float minValue, maxValue; ///< Smallest positive and largest values, before scaling
+        ComposeStats() : clippedPixels(0), adjustedPixels(0), pixels(0), minValue(0.0f), maxValue(0.0f) {}
+        void add(const ComposeStats & r);
+        /// In EV, between the smallest positive and the largest values
+        double dynamicRange() const {
+            return minValue > 0.0f ? std::log2(maxValue / minValue) : 0.0;
+        }
+    };
+    /// The feathered mask and unscaled result of a compose, reused by the next one
+    struct ComposeCache {
+        int featherRadius;
+        Array2D<float> map;
+        Array2D<float> composed;
+        float max;
+        ComposeStats stats; ///< Of the whole image, also when only an area was recomputed
+        std::vector<ComposeStats> tileStats; ///< Of each tileSide x tileSide tile, in row order
+        QRect updated; ///< Area recomputed by the last compose
+        static const int tileSide = 256;
+        ComposeCache() : featherRadius(-1), max(0.0f) {}
+    };
+
+    /// Blends straight into the output, keeping nothing for the next compose
+    Array2D<float> compose(const RawParameters & md, int featherRadius, ComposeStats * stats = nullptr) const;
+    /// Recomputes only the dirty area of the mask, plus the feather halo, if cache is valid.
+    /// It composes fromMask instead of the mask if given, a copy taken while no one edits it.
+    Array2D<float> compose(const RawParameters & md, int featherRadius, ComposeCache & cache, QRect dirty,
+                           const Array2D<uint8_t> * fromMask = nullptr) const;
+    /// Composes only region, without margins, and feathers only the part of the mask around it.
+    /// The result is scaled with the maximum of the region.
+    Array2D<float> composeRegion(const RawParameters & md, int featherRadius, QRect region) const;
+    /// Composes a CFA image factor times smaller, with the pattern proxyFC. Each pixel averages
+    /// the pixels of its color in a factor x factor block, so each block must contain all colors.
+    Array2D<float> composeProxy(const RawParameters & md, int featherRadius, const CFAPattern & proxyFC, int factor) const;
+    /// Fattens and blurs a mask, as compose does
+    static Array2D<float> featherMask(const Array2D<uint8_t> & mask, int featherRadius);
+    /// Blends image, of layer floor(p), with the next layer at (x, y), as compose does
+    static double blend(const RawParameters & params, const Image & image, const Image * next,
+                        int origLayer, uint16_t satThreshold, size_t x, size_t y, double p);
+    /// Places a composed image in the raw frame of params, scaled to params.max with the black levels
+    static Array2D<float> scaleToRaw(const Array2D<float> & composed, float max, const RawParameters & params);
+    /// The mask reduced step times, for composePreview. It is cheap enough to take it on the GUI
+    /// thread, so that composePreview does not read the mask while it is being edited.
+    Array2D<uint8_t> previewMask(int step) const;
+    /// Composes a downscaled version of the result, in the same units as value()
+    Array2D<float> composePreview(const RawParameters & md, int featherRadius, int step,
+                                  const Array2D<uint8_t> & smallMask) const;
 
     size_t size() const { return images.size(); }
 
@@ -70,6 +145,12 @@ public:
     bool isCropped() const {
         return width != images[0].getWidth() || height != images[0].getHeight();
     }
+    QPoint getCropOrigin() const {
+        return cropOrigin;
+    }
+    uint16_t getSaturationThreshold() const {
+        return satThreshold;
+    }
 
     Image & getImage(unsigned int i) {
         return images[i];
@@ -89,6 +170,11 @@ public:
     bool isLayerValidAt(int layer, size_t x, size_t y) const {
         return images[layer].contains(x, y);
     }
+    QRect getLayerRect(int layer) const {
+        if (layer < 0 || layer >= (int)images.size()) return QRect();
+        const Image & img = images[layer];
+        return QRect(img.getDeltaX(), img.getDeltaY(), img.getWidth(), img.getHeight());
+    }
     void calculateSaturationLevel(const RawParameters & params, bool useCustomWl = false);
 
 private:
@@ -97,8 +183,8 @@ private:
         EditableMaskImpl(const ImageStack * s) : EditableMask(), stack(s) {}
     private:
         const ImageStack * stack;
-        virtual bool isLayerValidAt(int layer, int x, int y) const {
-            return stack->isLayerValidAt(layer, x, y);
+        virtual QRect layerRect(int layer) const {
+            return stack->getLayerRect(layer);
         }
     };
 
@@ -107,8 +193,13 @@ private:
     Array2D<uint8_t> origMask;
     size_t width;
     size_t height;
+    QPoint cropOrigin;
     int flip;
     uint16_t satThreshold;
+
+    double blendAt(const RawParameters & params, size_t x, size_t y, double p) const;
+    /// Counts the pixel (x, y) of a composed image, of value v and mask layer, in stats
+    void addStats(ComposeStats & stats, size_t x, size_t y, float v, int layer) const;
 };
 
 } // namespace hdrmerge
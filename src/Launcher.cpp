@@ -20,15 +20,24 @@
  *
  */
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <QApplication>
+#include <QDir>
+#include <QFileInfo>
 #include <QTranslator>
 #include <QLibraryInfo>
 #include <QLocale>
 #include "Launcher.hpp"
 #include "ImageIO.hpp"
+#include "LibRawPool.hpp"
+#include "Prefetcher.hpp"
 #ifndef NO_GUI
 #include "MainWindow.hpp"
 #endif
@@ -37,9 +46,11 @@
 
 namespace hdrmerge {
 
-Launcher::Launcher(int argc, char * argv[]) : argc(argc), argv(argv), help(false) {
+Launcher::Launcher(int argc, char * argv[]) : argc(argc), argv(argv), prefetchBytes(0), help(false) {
     Log::setOutputStream(std::cout);
     saveOptions.previewSize = 2;
+    // The command line only reads or writes the analysis when asked to with --sidecar
+    generalOptions.useSidecar = false;
 }
 
 
@@ -70,29 +81,7 @@ struct CoutProgressIndicator : public ProgressIndicator {
 
 
 std::list<LoadOptions> Launcher::getBracketedSets() {
-    std::list<LoadOptions> result;
-    std::list<std::pair<ImageIO::QDateInterval, QString>> dateNames;
-    for (QString & name : generalOptions.fileNames) {
-        ImageIO::QDateInterval interval = ImageIO::getImageCreationInterval(name);
-        if (interval.start.isValid()) {
-            dateNames.emplace_back(interval, name);
-        } else {
-            // We cannot get time information, process it alone
-            result.push_back(generalOptions);
-            result.back().fileNames.clear();
-            result.back().fileNames.push_back(name);
-        }
-    }
-    dateNames.sort();
-    ImageIO::QDateInterval lastInterval;
-    for (auto & dateName : dateNames) {
-        if (lastInterval.start.isNull() || lastInterval.difference(dateName.first) > generalOptions.batchGap) {
-            result.push_back(generalOptions);
-            result.back().fileNames.clear();
-        }
-        result.back().fileNames.push_back(dateName.second);
-        lastInterval = dateName.first;
-    }
+    std::list<LoadOptions> result = ImageIO::getBracketedSets(generalOptions);
     int setNum = 0;
     for (auto & i : result) {
         Log::progressN("Set ", setNum++, ":");
@@ -115,17 +104,59 @@ int Launcher::automaticMerge() {
     }
     ImageIO io;
     int result = 0;
-    for (LoadOptions & options : optionsSet) {
-        if (!options.withSingles && options.fileNames.size() == 1) {
+    auto skipped = [] (const LoadOptions & options) {
+        return !options.withSingles && options.fileNames.size() == 1;
+    };
+    std::unique_ptr<Prefetcher> prefetcher;
+    if (prefetchBytes > 0 && optionsSet.size() > 1) {
+        prefetcher = std::make_unique<Prefetcher>(prefetchBytes);
+    }
+    std::ofstream report;
+    if (!reportFileName.isEmpty()) {
+        report.open(reportFileName.toLocal8Bit().constData());
+        if (report) {
+            report << "output,images,clipped %,adjusted highlights %,dynamic range EV,layer coverage %" << std::endl;
+        } else {
+            std::cerr << tr("Cannot write the report to %1").arg(reportFileName) << std::endl;
+        }
+    }
+    // The statistics are gathered by the compose pass of each save
+    auto writeReport = [&] (const QString & fileName, int numImages) {
+        const ImageStack::ComposeStats & stats = io.getComposeStats();
+        if (stats.pixels == 0) return;
+        double percent = 100.0 / stats.pixels;
+        Log::debug("Clipped ", stats.clippedPixels * percent, "%, adjusted ", stats.adjustedPixels * percent,
+                   "%, dynamic range ", stats.dynamicRange(), " EV");
+        if (!report.is_open()) return;
+        report << '"' << fileName << "\"," << numImages << std::fixed << std::setprecision(2)
+            << ',' << stats.clippedPixels * percent << ',' << stats.adjustedPixels * percent
+            << ',' << stats.dynamicRange() << ',';
+        for (size_t i = 0; i < stats.layerPixels.size(); ++i) {
+            report << (i ? ";" : "") << stats.layerPixels[i] * percent;
+        }
+        report << std::endl;
+    };
+    for (auto it = optionsSet.begin(); it != optionsSet.end(); ++it) {
+        LoadOptions & options = *it;
+        if (skipped(options)) {
             Log::progress(tr("Skipping single image %1").arg(options.fileNames.front()));
             continue;
         }
+        if (prefetcher) {
+            // Warm up the next set while this one is merged
+            auto next = std::find_if_not(std::next(it), optionsSet.end(), skipped);
+            if (next != optionsSet.end()) {
+                prefetcher->prefetch(next->fileNames);
+            }
+        }
         CoutProgressIndicator progress;
         int numImages = options.fileNames.size();
-        int result = io.load(options, progress);
-        if (result < numImages * 2) {
-            int format = result & 1;
-            int i = result >> 1;
+        options.outputFileName = saveOptions.fileName;
+        bool streaming = options.streaming && !options.quickLook && numImages > 1;
+        int loaded = streaming ? io.loadStreaming(options, progress) : io.load(options, progress);
+        if (loaded < numImages * 2) {
+            int format = loaded & 1;
+            int i = loaded >> 1;
             if (format) {
                 std::cerr << tr("Error loading %1, it has a different format.").arg(options.fileNames[i]) << std::endl;
             } else {
@@ -134,18 +165,47 @@ int Launcher::automaticMerge() {
             result = 1;
             continue;
         }
-        SaveOptions setOptions = saveOptions;
-        if (!setOptions.fileName.isEmpty()) {
-            setOptions.fileName = io.replaceArguments(setOptions.fileName, "");
-            int extPos = setOptions.fileName.lastIndexOf('.');
-            if (extPos > setOptions.fileName.length() || setOptions.fileName.mid(extPos) != ".dng") {
-                setOptions.fileName += ".dng";
+        auto outputFileName = [&] (const QString & pattern) {
+            if (pattern.isEmpty()) {
+                return io.buildOutputFileName();
             }
-        } else {
-            setOptions.fileName = io.buildOutputFileName();
+            QString fileName = io.replaceArguments(pattern, "");
+            int extPos = fileName.lastIndexOf('.');
+            if (extPos > fileName.length() || fileName.mid(extPos) != ".dng") {
+                fileName += ".dng";
+            }
+            return fileName;
+        };
+        if (options.quickLook) {
+            QFileInfo dngFile(outputFileName(saveOptions.fileName));
+            QString fileName = dngFile.dir().filePath(dngFile.completeBaseName() + ".jpg");
+            Log::progress(tr("Writing quick look to %1").arg(fileName));
+            if (!io.saveQuickLook(fileName, saveOptions.featherRadius)) {
+                result = 1;
+            } else {
+                writeReport(fileName, numImages);
+            }
+            continue;
         }
+        SaveOptions setOptions = saveOptions;
+        setOptions.fileName = outputFileName(setOptions.fileName);
         Log::progress(tr("Writing result to %1").arg(setOptions.fileName));
-        io.save(setOptions, progress);
+        for (SaveVariant & variant : setOptions.variants) {
+            variant.fileName = outputFileName(variant.fileName);
+            Log::progress(tr("Writing result to %1").arg(variant.fileName));
+        }
+        if (!io.save(setOptions, progress)) {
+            result = 1;
+            continue;
+        }
+        writeReport(setOptions.fileName, numImages);
+    }
+    LibRawPool::logStats();
+    if (report.is_open()) {
+        // Footer rows, with the counter in the images column
+        LibRawPool::Stats poolStats = LibRawPool::stats();
+        report << "\"LibRaw instances reused\"," << poolStats.hits << std::endl;
+        report << "\"LibRaw instances created\"," << poolStats.misses << std::endl;
     }
     return result;
 }
@@ -158,6 +218,10 @@ void Launcher::parseCommandLine() {
             if (++i < argc) {
                 saveOptions.fileName = argv[i];
             }
+        } else if (std::string("-M") == argv[i]) {
+            if (++i < argc) {
+                generalOptions.maskFileName = argv[i];
+            }
         } else if (std::string("-m") == argv[i]) {
             if (++i < argc) {
                 saveOptions.maskFileName = argv[i];
@@ -169,10 +233,21 @@ void Launcher::parseCommandLine() {
             Log::setMinimumPriority(0);
         } else if (std::string("--no-align") == argv[i]) {
             generalOptions.align = false;
+        } else if (std::string("--sampled-align") == argv[i]) {
+            generalOptions.sampledAlign = true;
+        } else if (std::string("--deghost") == argv[i]) {
+            generalOptions.deghost = true;
         } else if (std::string("--no-crop") == argv[i]) {
             generalOptions.crop = false;
         } else if (std::string("--batch") == argv[i] || std::string("-B") == argv[i]) {
             generalOptions.batch = true;
+        } else if (std::string("--sidecar") == argv[i]) {
+            generalOptions.useSidecar = true;
+            saveOptions.saveSidecar = true;
+        } else if (std::string("--streaming") == argv[i]) {
+            generalOptions.streaming = true;
+        } else if (std::string("--proxy") == argv[i]) {
+            saveOptions.proxy = true;
         } else if (std::string("--single") == argv[i]) {
             generalOptions.withSingles = true;
         } else if (std::string("--help") == argv[i]) {
@@ -182,7 +257,7 @@ void Launcher::parseCommandLine() {
                 try {
                     int value = std::stoi(argv[i]);
                     if (value == 32 || value == 24 || value == 16) saveOptions.bps = value;
-                } catch (std::invalid_argument & e) {
+                } catch (std::logic_error & e) {
                     std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
                 }
             }
@@ -191,16 +266,31 @@ void Launcher::parseCommandLine() {
                 try {
                     generalOptions.customWl = std::stoi(argv[i]);
                     generalOptions.useCustomWl = true;
-                } catch (std::invalid_argument & e) {
+                } catch (std::logic_error & e) {
                     std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
                     generalOptions.useCustomWl = false;
                 }
             }
+        } else if (std::string("--report") == argv[i]) {
+            if (++i < argc) {
+                reportFileName = QString::fromLocal8Bit(argv[i]);
+            }
+        } else if (std::string("--prefetch") == argv[i]) {
+            if (++i < argc) {
+                // Megabytes, without a sign and small enough to count in bytes
+                bool ok;
+                qulonglong megabytes = QString::fromLocal8Bit(argv[i]).toULongLong(&ok);
+                if (ok && megabytes <= (std::numeric_limits<size_t>::max() >> 20)) {
+                    prefetchBytes = (size_t)megabytes << 20;
+                } else {
+                    std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
+                }
+            }
         } else if (std::string("-g") == argv[i]) {
             if (++i < argc) {
                 try {
                     generalOptions.batchGap = std::stod(argv[i]);
-                } catch (std::invalid_argument & e) {
+                } catch (std::logic_error & e) {
                     std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
                 }
             }
@@ -208,8 +298,48 @@ void Launcher::parseCommandLine() {
             if (++i < argc) {
                 try {
                     saveOptions.featherRadius = std::stoi(argv[i]);
-                } catch (std::invalid_argument & e) {
+                } catch (std::logic_error & e) {
+                    std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
+                }
+            }
+        } else if (std::string("--variant") == argv[i]) {
+            if (++i < argc) {
+                // BPS,RADIUS,OUT_FILE; the file name may contain commas
+                QString spec = QString::fromLocal8Bit(argv[i]);
+                bool bpsOk, radiusOk;
+                int bps = spec.section(',', 0, 0).toInt(&bpsOk);
+                int radius = spec.section(',', 1, 1).toInt(&radiusOk);
+                QString fileName = spec.section(',', 2);
+                if (bpsOk && radiusOk && (bps == 32 || bps == 24 || bps == 16) && radius >= 0 && !fileName.isEmpty()) {
+                    saveOptions.variants.emplace_back(fileName, bps, radius);
+                } else {
+                    std::cerr << tr("Invalid %1 parameter, ignoring it.").arg(argv[i - 1]) << std::endl;
+                }
+            }
+        } else if (std::string("--roi") == argv[i]) {
+            if (++i < argc) {
+                QStringList values = QString::fromLocal8Bit(argv[i]).split(',');
+                bool ok = values.size() == 4;
+                int roi[4];
+                for (int j = 0; ok && j < 4; ++j) {
+                    roi[j] = values[j].toInt(&ok);
+                }
+                if (ok && roi[0] >= 0 && roi[1] >= 0 && roi[2] > 0 && roi[3] > 0) {
+                    saveOptions.roi = QRect(roi[0], roi[1], roi[2], roi[3]);
+                } else {
+                    std::cerr << tr("Invalid %1 parameter, ignoring it.").arg(argv[i - 1]) << std::endl;
+                }
+            }
+        } else if (std::string("--quicklook") == argv[i]) {
+            if (++i < argc) {
+                std::string size(argv[i]);
+                if (size == "half") {
+                    generalOptions.quickLook = 2;
+                } else if (size == "quarter") {
+                    generalOptions.quickLook = 4;
+                } else {
                     std::cerr << tr("Invalid %1 parameter, using default.").arg(argv[i - 1]) << std::endl;
+                    generalOptions.quickLook = 4;
                 }
             }
         } else if (std::string("-p") == argv[i]) {
@@ -257,15 +387,44 @@ void Launcher::showHelp() {
     std::cout << "    " << "-B|--batch    " << tr("Batch mode: Input images are automatically grouped into bracketed sets,") << std::endl;
     std::cout << "    " << "              " << tr("by comparing the creation time. Implies -a if no output file name is given.") << std::endl;
     std::cout << "    " << "-g gap        " << tr("Batch gap, maximum difference in seconds between two images of the same set.") << std::endl;
+    std::cout << "    " << "--prefetch MB " << tr("In batch mode, reads up to MB megabytes of the next set ahead, while the") << std::endl;
+    std::cout << "    " << "              " << tr("current one is merged. Useful with network storage.") << std::endl;
+    std::cout << "    " << "--report FILE " << tr("Writes the clipping, dynamic range and layer coverage of each result") << std::endl;
+    std::cout << "    " << "              " << tr("to FILE, as comma separated values, followed by the number of reused and") << std::endl;
+    std::cout << "    " << "              " << tr("newly created LibRaw instances.") << std::endl;
     std::cout << "    " << "--single      " << tr("Include single images in batch mode (the default is to skip them.)") << std::endl;
     std::cout << "    " << "-b BPS        " << tr("Bits per sample, can be 16, 24 or 32.") << std::endl;
     std::cout << "    " << "--no-align    " << tr("Do not auto-align source images.") << std::endl;
+    std::cout << "    " << "--sampled-align" << std::endl;
+    std::cout << "    " << "              " << tr("Aligns the images comparing only the most detailed areas at full resolution.") << std::endl;
+    std::cout << "    " << "--deghost     " << tr("Detects moving objects and takes each one from a single image.") << std::endl;
     std::cout << "    " << "--no-crop     " << tr("Do not crop the output image to the optimum size.") << std::endl;
+    std::cout << "    " << "--sidecar     " << tr("Reuses the analysis of the images from a .hdrmerge file next to the output,") << std::endl;
+    std::cout << "    " << "              " << tr("and saves it there for the next merge.") << std::endl;
     std::cout << "    " << "-m MASK_FILE  " << tr("Saves the mask to MASK_FILE as a PNG image.") << std::endl;
+    std::cout << "    " << "-M MASK_FILE  " << tr("Uses the mask in MASK_FILE, as saved with -m, instead of generating it.") << std::endl;
     std::cout << "    " << "              " << tr("Besides the parameters accepted by -o, it also accepts:") << std::endl;
     std::cout << "    " << "              - %of: " << tr("Replaced by the base file name of the output file.") << std::endl;
     std::cout << "    " << "              - %od: " << tr("Replaced by the directory name of the output file.") << std::endl;
     std::cout << "    " << "-r radius     " << tr("Mask blur radius, to soften transitions between images. Default is 3 pixels.") << std::endl;
+    std::cout << "    " << "--variant BPS,RADIUS,OUT_FILE" << std::endl;
+    std::cout << "    " << "              " << tr("Also writes OUT_FILE with BPS bits per sample and mask blur radius RADIUS,") << std::endl;
+    std::cout << "    " << "              " << tr("reusing the work done for the main output. It accepts the parameters of -o") << std::endl;
+    std::cout << "    " << "              " << tr("and can be given several times.") << std::endl;
+    std::cout << "    " << "--roi X,Y,WIDTH,HEIGHT" << std::endl;
+    std::cout << "    " << "              " << tr("Only merges and writes this region of the image, in sensor orientation.") << std::endl;
+    std::cout << "    " << "              " << tr("It is scaled to its own brightest pixel, so its values are not those of the same") << std::endl;
+    std::cout << "    " << "              " << tr("region in a full merge. A region outside the image is an error.") << std::endl;
+    std::cout << "    " << "--streaming   " << tr("Keeps at most two images in memory, to merge long brackets. Each image is") << std::endl;
+    std::cout << "    " << "              " << tr("decoded twice, and -m, --roi, --proxy and --variant are not available.") << std::endl;
+    std::cout << "    " << "--proxy       " << tr("Writes a proxy DNG, binned 2x2. X-Trans images are binned 3x3 into a Bayer") << std::endl;
+    std::cout << "    " << "              " << tr("pattern.") << std::endl;
+    std::cout << "    " << "--quicklook size" << std::endl;
+    std::cout << "    " << "              " << tr("Only writes a small JPEG of each merge, for culling, instead of the DNG.") << std::endl;
+    std::cout << "    " << "              " << tr("size is half or quarter: the raw images are binned 2x2 or 4x4 before they are") << std::endl;
+    std::cout << "    " << "              " << tr("merged, and the JPEG has one pixel per CFA block of the binned image, so it is") << std::endl;
+    std::cout << "    " << "              " << tr("1/4 or 1/8 of the width of the raw image, 1/12 or 1/24 for X-Trans. The output") << std::endl;
+    std::cout << "    " << "              " << tr("file name is the one of -o or -a, with the .jpg extension.") << std::endl;
     std::cout << "    " << "-p size       " << tr("Preview size. Can be full, half or none.") << std::endl;
     std::cout << "    " << "-v            " << tr("Verbose mode.") << std::endl;
     std::cout << "    " << "-vv           " << tr("Debug mode.") << std::endl;
@@ -288,6 +447,9 @@ bool Launcher::checkGUI() {
             useGUI = false;
         } else if (std::string("-B") == argv[i]) {
             useGUI = false;
+        } else if (std::string("--quicklook") == argv[i]) {
+            ++i;
+            useGUI = false;
         } else if (std::string("--help") == argv[i]) {
             return false;
         } else if (argv[i][0] != '-') {
@@ -25,6 +25,7 @@
 
 #include <list>
 #include <string>
+#include <QString>
 #include "ImageStack.hpp"
 
 namespace hdrmerge {
@@ -48,6 +49,8 @@ private:
     char ** argv;
     LoadOptions generalOptions;
     SaveOptions saveOptions;
+    QString reportFileName; ///< Statistics of each merged set, in batch mode
+    size_t prefetchBytes; ///< Read ahead budget for the next set in batch mode, 0 to disable
     bool help;
 };
 
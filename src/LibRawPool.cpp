@@ -0,0 +1,102 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <mutex>
+#include <vector>
+#include "LibRawPool.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+struct Pool {
+    static const size_t maxIdle = 8;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<LibRaw>> idle;
+    size_t hits = 0, misses = 0;
+    bool haveDefaults = false;
+    libraw_output_params_t defaultParams;
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 21, 0)
+    libraw_raw_unpack_params_t defaultRawParams;
+#endif
+};
+
+
+static Pool & getPool() {
+    static Pool pool;
+    return pool;
+}
+
+
+LibRawPool::Handle LibRawPool::acquire() {
+    Pool & pool = getPool();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.idle.empty()) {
+            ++pool.hits;
+            std::unique_ptr<LibRaw> raw = std::move(pool.idle.back());
+            pool.idle.pop_back();
+            return Handle(std::move(raw));
+        }
+        ++pool.misses;
+    }
+    // Construct it outside of the lock, it is the expensive part
+    std::unique_ptr<LibRaw> raw = std::make_unique<LibRaw>();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (!pool.haveDefaults) {
+        pool.defaultParams = raw->imgdata.params;
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 21, 0)
+        pool.defaultRawParams = raw->imgdata.rawparams;
+#endif
+        pool.haveDefaults = true;
+    }
+    return Handle(std::move(raw));
+}
+
+
+void LibRawPool::release(std::unique_ptr<LibRaw> && raw) {
+    // recycle() frees the image data, but keeps the parameters set by the last user
+    raw->recycle();
+    Pool & pool = getPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.idle.size() < Pool::maxIdle) {
+        raw->imgdata.params = pool.defaultParams;
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 21, 0)
+        raw->imgdata.rawparams = pool.defaultRawParams;
+#endif
+        pool.idle.push_back(std::move(raw));
+    }
+}
+
+
+LibRawPool::Stats LibRawPool::stats() {
+    Pool & pool = getPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return Stats{pool.hits, pool.misses};
+}
+
+
+void LibRawPool::logStats() {
+    Stats s = stats();
+    Log::debug("LibRaw pool: ", s.hits, " instances reused, ", s.misses, " created");
+}
+
+} // namespace hdrmerge
@@ -0,0 +1,72 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _LIBRAWPOOL_HPP_
+#define _LIBRAWPOOL_HPP_
+
+#include <memory>
+#include <libraw.h>
+
+namespace hdrmerge {
+
+/// Recycled LibRaw instances, shared by all threads. They come back with their default parameters.
+class LibRawPool {
+public:
+    /// Exclusive use of an instance, until it is destroyed
+    class Handle {
+    public:
+        Handle(std::unique_ptr<LibRaw> && r) : raw(std::move(r)) {}
+        Handle(Handle && other) = default;
+        ~Handle() {
+            if (raw) LibRawPool::release(std::move(raw));
+        }
+        LibRaw * get() const {
+            return raw.get();
+        }
+        LibRaw * operator->() const {
+            return raw.get();
+        }
+        LibRaw & operator*() const {
+            return *raw;
+        }
+
+    private:
+        std::unique_ptr<LibRaw> raw;
+    };
+
+    /// Number of acquired instances that were reused (hits) and newly created (misses)
+    struct Stats {
+        size_t hits, misses;
+    };
+
+    static Handle acquire();
+    static Stats stats();
+    /// Logs the number of reused and newly created instances
+    static void logStats();
+
+private:
+    static void release(std::unique_ptr<LibRaw> && raw);
+};
+
+} // namespace hdrmerge
+
+#endif // _LIBRAWPOOL_HPP_
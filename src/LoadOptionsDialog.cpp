@@ -70,6 +70,10 @@ LoadOptionsDialog::LoadOptionsDialog(QWidget * parent, Qt::WindowFlags f)
     alignBox->setChecked(settings.value("alignOnLoad", true).toBool());
     layout->addWidget(alignBox, 0);
 
+    deghostBox = new QCheckBox(tr("Remove ghosts of moving objects."), this);
+    deghostBox->setChecked(settings.value("deghostOnLoad", false).toBool());
+    layout->addWidget(deghostBox, 0);
+
     cropBox = new QCheckBox(tr("Crop result image to optimal size."), this);
     cropBox->setChecked(settings.value("cropOnLoad", true).toBool());
     layout->addWidget(cropBox, 0);
@@ -157,6 +161,8 @@ void LoadOptionsDialog::accept() {
     QSettings settings;
     align = alignBox->isChecked();
     settings.setValue("alignOnLoad", align);
+    deghost = deghostBox->isChecked();
+    settings.setValue("deghostOnLoad", deghost);
     crop = cropBox->isChecked();
     settings.setValue("cropOnLoad", crop);
     useCustomWl = customWhiteLevelBox->isChecked();
@@ -50,6 +50,7 @@ private:
 
     QListWidget * fileList;
     QCheckBox * alignBox;
+    QCheckBox * deghostBox;
     QCheckBox * cropBox;
     QCheckBox * customWhiteLevelBox;
     QSpinBox * customWhiteLevelSpinBox;
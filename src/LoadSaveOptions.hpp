@@ -25,20 +25,39 @@
 
 #include <vector>
 #include <QString>
+#include <QRect>
 
 namespace hdrmerge {
 
 struct LoadOptions {
     std::vector<QString> fileNames;
     bool align;
+    bool sampledAlign; ///< Compare the finest alignment levels only in the tiles with most edges
     bool crop;
+    bool deghost; ///< Fill each moving area with a single layer, see ImageStack::deghost
+    QString maskFileName; ///< If not empty, a mask image that replaces the generated one, see MaskFile
     bool useCustomWl;
     uint16_t customWl;
     bool batch;
     double batchGap;
     bool withSingles;
-    LoadOptions() : align(true), crop(true), useCustomWl(false), customWl(16383), batch(false), batchGap(2.0),
-        withSingles(false) {}
+    bool halfSizeFirst; ///< Process a half size stack first, see ImageIO::processFullResolution
+    bool useSidecar;
+    QString outputFileName; ///< Output file pattern, to find its sidecar, or empty for the default name
+    int quickLook; ///< If 2 or 4, only a stack binned by that factor is loaded, see ImageIO::saveQuickLook
+    bool streaming; ///< Keep at most two images in memory, see ImageIO::loadStreaming
+    LoadOptions() : align(true), sampledAlign(false), crop(true), deghost(false), useCustomWl(false), customWl(16383), batch(false), batchGap(2.0),
+        withSingles(false), halfSizeFirst(false), useSidecar(true), quickLook(0), streaming(false) {}
+};
+
+
+/// An additional output of the same stack, see SaveOptions::variants
+struct SaveVariant {
+    QString fileName;
+    int bps;
+    int featherRadius;
+    SaveVariant() : bps(16), featherRadius(3) {}
+    SaveVariant(const QString & f, int b, int r) : fileName(f), bps(b), featherRadius(r) {}
 };
 
 
@@ -49,7 +68,12 @@ struct SaveOptions {
     bool saveMask;
     QString maskFileName;
     int featherRadius;
-    SaveOptions() : bps(16), previewSize(0), saveMask(false), featherRadius(3) {}
+    bool saveSidecar; ///< Where the default output would go, or the output pattern of the load options
+    /// Written along with fileName, sharing the composed image of each feather radius, the preview and the metadata
+    std::vector<SaveVariant> variants;
+    QRect roi; ///< If not null, only this region of the merged image is composed and written
+    bool proxy; ///< Write a CFA image binned 2x2 (3x3 for X-Trans), see ImageStack::composeProxy
+    SaveOptions() : bps(16), previewSize(0), saveMask(false), featherRadius(3), saveSidecar(false), proxy(false) {}
 };
 
 } // namespace hdrmerge
@@ -20,8 +20,13 @@
  *
  */
 
+#include <algorithm>
 #include <list>
 #include <cmath>
+#include <memory>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "MainWindow.hpp"
 #include <QActionGroup>
 #include <QApplication>
@@ -34,6 +39,7 @@
 #include <QMenuBar>
 #include <QProgressDialog>
 #include <QSettings>
+#include <QThread>
 #include <QUrl>
 #include "config.h"
 #include "AboutDialog.hpp"
@@ -44,6 +50,7 @@
 #include "DngPropertiesDialog.hpp"
 #include "LoadOptionsDialog.hpp"
 #include "FileSystem.hpp"
+#include "SetQueue.hpp"
 
 namespace hdrmerge {
 
@@ -67,7 +74,19 @@ public:
 };
 
 
-MainWindow::MainWindow() : QMainWindow() {
+MainWindow::MainWindow() : QMainWindow(), ioBusy(false) {
+    // Saving again after some touch-ups only recomposes the edited areas
+    io.enableSessionCache(true);
+    fullResolutionWatcher = new QFutureWatcher<void>(this);
+    connect(fullResolutionWatcher, SIGNAL(finished()), this, SLOT(fullResolutionLoaded()));
+    // The result is composed ahead of a save once the edits settle
+    precomposeTimer = new QTimer(this);
+    precomposeTimer->setSingleShot(true);
+    precomposeTimer->setInterval(2000);
+    connect(precomposeTimer, SIGNAL(timeout()), this, SLOT(precompose()));
+    setQueue = new SetQueue(QSettings().value("residentSets", 3).toInt(), this);
+    connect(setQueue, SIGNAL(changed()), this, SLOT(updateQueueStatus()));
+    connect(setQueue, SIGNAL(saveFailed(const QString &)), this, SLOT(saveFailed(const QString &)));
     createWidgets();
     createActions();
     createToolbars();
@@ -87,12 +106,15 @@ void MainWindow::createWidgets() {
     setStatusBar(statusBar);
     statusLabel = new QLabel(statusBar);
     statusBar->addWidget(statusLabel);
+    queueLabel = new QLabel(statusBar);
+    statusBar->addPermanentWidget(queueLabel);
 
     previewArea = new DraggableScrollArea(this);
     setCentralWidget(previewArea);
     preview = new PreviewWidget(io.getImageStack(), previewArea);
     previewArea->setWidget(preview);
     connect(preview, SIGNAL(pixelUnderMouse(int, int)), this, SLOT(setPixelStatus(int, int)));
+    connect(preview, SIGNAL(maskEdited()), this, SLOT(schedulePrecompose()));
 
     radiusBox = new QSpinBox();
     radiusBox->setRange(0, 200);
@@ -114,6 +136,15 @@ void MainWindow::createWidgets() {
     exposureSlider->setMaximumWidth(200);
     exposureSlider->setToolTip(tr("Preview brightness. It does NOT affect the HDR result."));
     connect(exposureSlider, SIGNAL(valueChanged(int)), preview, SLOT(setExposureMultiplier(int)));
+
+    featherBox = new QSpinBox();
+    featherBox->setRange(0, 1000);
+    featherBox->setToolTip(tr("Feather radius of the merged result preview."));
+    featherBox->setValue(QSettings().value("featherRadius", 3).toInt());
+    preview->setFeatherRadius(featherBox->value());
+    connect(featherBox, SIGNAL(valueChanged(int)), preview, SLOT(setFeatherRadius(int)));
+    connect(featherBox, SIGNAL(valueChanged(int)), this, SLOT(saveFeatherRadius(int)));
+    connect(featherBox, SIGNAL(valueChanged(int)), this, SLOT(schedulePrecompose()));
 }
 
 
@@ -122,6 +153,15 @@ void MainWindow::createActions() {
     loadImagesAction->setShortcut(QKeySequence::Open);
     connect(loadImagesAction, SIGNAL(triggered()), this, SLOT(loadImages()));
 
+    loadSetsAction = new QAction(tr("Open &bracketed sets..."), this);
+    connect(loadSetsAction, SIGNAL(triggered()), this, SLOT(loadSets()));
+
+    nextSetAction = new QAction(tr("&Next set"), this);
+    nextSetAction->setShortcut(tr("Ctrl+N"));
+    nextSetAction->setToolTip(tr("Discard the current set and edit the next one."));
+    nextSetAction->setEnabled(false);
+    connect(nextSetAction, SIGNAL(triggered()), this, SLOT(showNextSet()));
+
     quitAction = new QAction(tr("&Quit"), this);
     quitAction->setShortcut(QKeySequence::Quit);
     connect(quitAction, SIGNAL(triggered()), this, SLOT(close()));
@@ -155,12 +195,19 @@ void MainWindow::createActions() {
     rmGhostAction->setCheckable(true);
     rmGhostAction->setDisabled(true);
     connect(rmGhostAction, SIGNAL(toggled(bool)), preview, SLOT(toggleRmPixelsTool(bool)));
+
+    blendedPreviewAction = new QAction(tr("Merged"), this);
+    blendedPreviewAction->setToolTip(tr("Preview the merged result instead of the source of each pixel."));
+    blendedPreviewAction->setCheckable(true);
+    connect(blendedPreviewAction, SIGNAL(toggled(bool)), preview, SLOT(toggleBlended(bool)));
 }
 
 
 void MainWindow::createMenus() {
     fileMenu = new QMenu(tr("&File"));
     fileMenu->addAction(loadImagesAction);
+    fileMenu->addAction(loadSetsAction);
+    fileMenu->addAction(nextSetAction);
     fileMenu->addAction(mergeAction);
     fileMenu->addSeparator();
     fileMenu->addAction(quitAction);
@@ -199,6 +246,10 @@ void MainWindow::createToolbars() {
     toolBar->addSeparator();
     toolBar->addWidget(new QLabel(" " + tr("Brightness:"), toolBar));
     toolBar->addWidget(exposureSlider);
+    toolBar->addSeparator();
+    toolBar->addAction(blendedPreviewAction);
+    toolBar->addWidget(new QLabel(" " + tr("Feather:"), toolBar));
+    toolBar->addWidget(featherBox);
     connect(toolActionGroup, SIGNAL(triggered(QAction *)), this, SLOT(toolSelected(QAction *)));
 
     layerSelector = addToolBar("Layers");
@@ -212,6 +263,12 @@ void MainWindow::createToolbars() {
 }
 
 
+void MainWindow::saveFeatherRadius(int r) {
+    QSettings settings;
+    settings.setValue("featherRadius", r);
+}
+
+
 void MainWindow::setPixelStatus(int x, int y) {
     int l = io.getImageStack().getImageAt(x, y);
     Image & img = io.getImageStack().getImage(l);
@@ -226,6 +283,11 @@ void MainWindow::setPixelStatus(int x, int y) {
 
 
 void MainWindow::closeEvent(QCloseEvent * event) {
+    fullResolutionLoad.waitForFinished();
+    precomposeTimer->stop();
+    precomposition.waitForFinished();
+    // Background saves must complete
+    setQueue->waitForAll();
     QSettings settings;
     settings.setValue("windowGeometry", saveGeometry());
     settings.setValue("windowState", saveState());
@@ -245,32 +307,196 @@ void MainWindow::loadImages() {
         preloadFiles.clear();
     }
     if (lod.exec() && !lod.fileNames.empty()) {
-        int numImages = lod.fileNames.size();
+        waitForFullResolution();
+        waitForPrecompose();
+        ioBusy = true;
+        // The stack is going to change under the preview
+        preview->stopRender();
+        // Show a half size stack first, the full resolution one is processed in the background
+        lod.halfSizeFirst = true;
         ProgressDialog progress(this);
         progress.setWindowTitle(tr("Open raw images"));
         QFuture<int> error = QtConcurrent::run(std::function<int()>([&] () { return io.load(lod, progress); }));
         while (error.isRunning())
             QApplication::instance()->processEvents(QEventLoop::ExcludeUserInputEvents);
         int result = error.result();
-        if (result < numImages * 2) {
-            int i = result >> 1;
-            QString message = result & 1 ?
-            tr("File %1 has not the same format as the previous ones.").arg(lod.fileNames[i]) :
-            tr("Unable to open file %1.").arg(lod.fileNames[i]);
-            QMessageBox::warning(this, tr("Error opening file"), message);
+        ioBusy = false;
+        showLoaded(result, lod.fileNames);
+    }
+    setToolFromKey();
+}
+
+
+void MainWindow::showLoaded(int result, const std::vector<QString> & fileNames) {
+    int numImages = fileNames.size();
+    if (result < numImages * 2) {
+        int i = result >> 1;
+        QString message = result & 1 ?
+        tr("File %1 has not the same format as the previous ones.").arg(fileNames[i]) :
+        tr("Unable to open file %1.").arg(fileNames[i]);
+        QMessageBox::warning(this, tr("Error opening file"), message);
+    }
+
+    numImages = io.getImageStack().size();
+    // Create GUI
+    if (numImages > 0) {
+        preview->setOutputParameters(io.getOutputParameters());
+    }
+    preview->reload();
+    mergeAction->setEnabled(numImages > 0);
+    addGhostAction->setEnabled(numImages > 1);
+    rmGhostAction->setEnabled(numImages > 1);
+    radiusSlider->setValue(50);
+    exposureSlider->setValue(1000);
+    createLayerSelector();
+    if (io.hasPendingFullResolution()) {
+        setStatus(tr("Loading full resolution..."));
+        fullResolutionLoad = QtConcurrent::run([this] () { io.processFullResolution(); });
+        fullResolutionWatcher->setFuture(fullResolutionLoad);
+    }
+    schedulePrecompose();
+    updateQueueStatus();
+}
+
+
+void MainWindow::loadSets() {
+    LoadOptionsDialog lod(this);
+    if (lod.exec() && !lod.fileNames.empty()) {
+        std::list<LoadOptions> sets = ImageIO::getBracketedSets(lod);
+        if (!lod.withSingles) {
+            sets.remove_if([] (const LoadOptions & set) { return set.fileNames.size() == 1; });
         }
+        if (sets.empty()) {
+            QMessageBox::warning(this, tr("Error opening file"), tr("There are no bracketed sets in these images."));
+        } else {
+            setQueue->enqueue(sets);
+            if (io.getImageStack().size() == 0) {
+                showNextSet();
+            }
+        }
+    }
+    updateQueueStatus();
+    setToolFromKey();
+}
+
 
-        numImages = io.getImageStack().size();
-        // Create GUI
+void MainWindow::showNextSet() {
+    if (setQueue->pending() == 0) return;
+    waitForFullResolution();
+    waitForPrecompose();
+    // The stack is going to change under the preview
+    preview->stopRender();
+    setQueue->requestNext();
+    if (!setQueue->isNextReady()) {
+        setStatus(tr("Loading the next set..."));
+        ioBusy = true;
+        while (!setQueue->isNextReady())
+            QApplication::instance()->processEvents(QEventLoop::ExcludeUserInputEvents);
+        ioBusy = false;
+        setStatus(QString());
+    }
+    LoadOptions options;
+    int result = setQueue->takeNext(io, options);
+    showLoaded(result, options.fileNames);
+    setToolFromKey();
+}
+
+
+void MainWindow::updateQueueStatus() {
+    nextSetAction->setEnabled(setQueue->pending() > 0);
+    QStringList status;
+    if (setQueue->pending() > 0) {
+        status << tr("%n set(s) queued", "", setQueue->pending());
+    }
+    if (setQueue->saving() > 0) {
+        status << tr("saving %n set(s)", "", setQueue->saving());
+    }
+    queueLabel->setText(status.join(", "));
+}
+
+
+void MainWindow::saveFailed(const QString & fileName) {
+    QMessageBox::warning(this, tr("Error saving file"), tr("Unable to save %1.").arg(fileName));
+}
+
+
+void MainWindow::fullResolutionLoaded() {
+    if (fullResolutionLoad.isRunning() || !io.hasPendingFullResolution()) return;
+    preview->stopRender();
+    waitForPrecompose();
+    if (!io.installFullResolution()) {
+        setStatus(QString());
+        QMessageBox::warning(this, tr("Error opening file"), tr("Unable to load the full resolution images."));
         preview->reload();
-        mergeAction->setEnabled(numImages > 0);
-        addGhostAction->setEnabled(numImages > 1);
-        rmGhostAction->setEnabled(numImages > 1);
-        radiusSlider->setValue(50);
-        exposureSlider->setValue(1000);
+        mergeAction->setEnabled(false);
+        addGhostAction->setEnabled(false);
+        rmGhostAction->setEnabled(false);
         createLayerSelector();
+        return;
     }
-    setToolFromKey();
+    preview->setOutputParameters(io.getOutputParameters());
+    preview->reload();
+    if (layerSelectorGroup->checkedAction()) {
+        layerSelected(layerSelectorGroup->checkedAction());
+    }
+    preview->setExposureMultiplier(exposureSlider->value());
+    setStatus(QString());
+    schedulePrecompose();
+}
+
+
+void MainWindow::schedulePrecompose() {
+    if (io.getImageStack().size() > 0) {
+        precomposeTimer->start();
+    }
+}
+
+
+void MainWindow::precompose() {
+    if (ioBusy || precomposition.isRunning()) {
+        // Try again when it finishes
+        precomposeTimer->start();
+        return;
+    }
+    if (io.getImageStack().size() == 0 || io.hasPendingFullResolution()) return;
+    // Edits made from now on are left for the next precomposition, or the save
+    EditableMask & mask = io.getImageStack().getMask();
+    QRect dirty = mask.getDirtyArea();
+    mask.clearDirtyArea();
+    // The brush keeps editing the mask, the compose reads a copy of it
+    auto snapshot = std::make_shared<const Array2D<uint8_t>>(mask);
+    int radius = featherBox->value();
+    int previewSize = QSettings().value("previewSize", 2).toInt();
+    precomposition = QtConcurrent::run([this, radius, previewSize, dirty, snapshot] () {
+        // Leave the processors to the preview while the user edits
+        QThread * thread = QThread::currentThread();
+        QThread::Priority priority = thread->priority();
+        thread->setPriority(QThread::LowestPriority);
+#ifdef _OPENMP
+        // A low priority thread still opens a full team, half of them is enough
+        int maxThreads = omp_get_max_threads();
+        omp_set_num_threads(std::max(1, maxThreads / 2));
+#endif
+        io.precompose(radius, previewSize, dirty, *snapshot);
+#ifdef _OPENMP
+        omp_set_num_threads(maxThreads);
+#endif
+        thread->setPriority(priority);
+    });
+}
+
+
+void MainWindow::waitForPrecompose() {
+    precomposeTimer->stop();
+    while (precomposition.isRunning())
+        QApplication::instance()->processEvents(QEventLoop::ExcludeUserInputEvents);
+}
+
+
+void MainWindow::waitForFullResolution() {
+    while (fullResolutionLoad.isRunning())
+        QApplication::instance()->processEvents(QEventLoop::ExcludeUserInputEvents);
+    fullResolutionLoaded();
 }
 
 
@@ -356,13 +582,29 @@ void MainWindow::saveResult() {
             if (dpd.exec()) {
                 settings.setValue("lastSaveDirectory", QFileInfo(file).absolutePath());
                 dpd.fileName = file;
+                waitForFullResolution();
+                if (setQueue->pending() > 0) {
+                    // Save in the background and go on with the next set
+                    waitForPrecompose();
+                    preview->stopRender();
+                    setQueue->saveInBackground(io, dpd);
+                    showNextSet();
+                    return;
+                }
+                // A precomposition with these options leaves only the encoding to the save
+                waitForPrecompose();
+                ioBusy = true;
                 ProgressDialog pd(this);
                 pd.setWindowTitle(tr("Save DNG file"));
-                QFuture<void> result = QtConcurrent::run(std::function<void()>([&]() {
-                    io.save(dpd, pd);
+                QFuture<bool> result = QtConcurrent::run(std::function<bool()>([&]() {
+                    return io.save(dpd, pd);
                 }));
                 while (result.isRunning())
                     QApplication::instance()->processEvents(QEventLoop::ExcludeUserInputEvents);
+                ioBusy = false;
+                if (!result.result()) {
+                    saveFailed(file);
+                }
             }
         }
     }
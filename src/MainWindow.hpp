@@ -34,6 +34,9 @@
 #include <QSpinBox>
 #include <QSlider>
 #include <QStatusBar>
+#include <QTimer>
+#include <QFuture>
+#include <QFutureWatcher>
 #include "ImageIO.hpp"
 
 
@@ -41,6 +44,7 @@ namespace hdrmerge {
 
 class PreviewWidget;
 class DraggableScrollArea;
+class SetQueue;
 
 class MainWindow : public QMainWindow {
 public:
@@ -67,8 +71,16 @@ protected:
 private slots:
     void about();
     void loadImages();
+    void loadSets();
+    void showNextSet();
+    void updateQueueStatus();
+    void saveFailed(const QString & fileName);
     void saveResult();
     void layerSelected(QAction * action);
+    void saveFeatherRadius(int r);
+    void fullResolutionLoaded();
+    void precompose();
+    void schedulePrecompose();
     void toolSelected(QAction * action) {
         lastTool = action;
     }
@@ -80,10 +92,15 @@ private:
     void createToolbars();
     void createLayerSelector();
     void setToolFromKey();
+    void waitForFullResolution();
+    void waitForPrecompose();
+    void showLoaded(int result, const std::vector<QString> & fileNames);
 
     Q_OBJECT
 
     QAction * loadImagesAction;
+    QAction * loadSetsAction;
+    QAction * nextSetAction;
     QAction * quitAction;
     QAction * undoAction;
     QAction * redoAction;
@@ -93,6 +110,7 @@ private:
     QAction * dragToolAction;
     QAction * addGhostAction;
     QAction * rmGhostAction;
+    QAction * blendedPreviewAction;
     QAction * lastTool;
 
     QMenu * fileMenu;
@@ -106,10 +124,18 @@ private:
     QActionGroup * layerSelectorGroup;
     QToolBar * layerSelector;
     QSlider * exposureSlider;
+    QSpinBox * featherBox;
     QStatusBar * statusBar;
     QLabel * statusLabel;
+    QLabel * queueLabel;
 
     ImageIO io;
+    QFuture<void> fullResolutionLoad;
+    QFutureWatcher<void> * fullResolutionWatcher;
+    QFuture<void> precomposition;
+    QTimer * precomposeTimer;
+    bool ioBusy; ///< Loading or saving, the stack must not be precomposed
+    SetQueue * setQueue;
     std::vector<QString> preloadFiles;
 };
 
@@ -0,0 +1,146 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <vector>
+#include <zlib.h>
+#include <QFile>
+#include <QImage>
+#include "MaskFile.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+static void putUint32(std::vector<uint8_t> & out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+
+static bool writeChunk(QFile & file, const char * type, const std::vector<uint8_t> & data) {
+    std::vector<uint8_t> chunk;
+    chunk.reserve(data.size() + 12);
+    putUint32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putUint32(chunk, crc32(crc32(0, Z_NULL, 0), &chunk[4], data.size() + 4));
+    return file.write((const char *)chunk.data(), chunk.size()) == (qint64)chunk.size();
+}
+
+
+bool MaskFile::write(const QString & fileName, const Array2D<uint8_t> & mask, int numLayers) {
+    Timer t("Write mask");
+    const size_t width = mask.getWidth(), height = mask.getHeight();
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    static const char signature[] = "\x89PNG\r\n\x1a\n";
+    file.write(signature, 8);
+    std::vector<uint8_t> header;
+    putUint32(header, width);
+    putUint32(header, height);
+    header.insert(header.end(), { 8, 3, 0, 0, 0 }); // 8 bits, indexed, deflate, no filter, no interlace
+    std::vector<uint8_t> palette;
+    int numColors = numLayers - 1;
+    for (int c = 0; c < numColors; ++c) {
+        uint8_t gray = (256 * c) / numColors;
+        palette.insert(palette.end(), { gray, gray, gray });
+    }
+    palette.insert(palette.end(), { 255, 255, 255 });
+    bool ok = writeChunk(file, "IHDR", header) && writeChunk(file, "PLTE", palette);
+
+    // Each strip is an independent raw deflate block sequence, ended with a sync flush but the last one,
+    // so that their concatenation is a valid stream. Each one goes into its own IDAT chunk.
+    const size_t stripRows = 256;
+    const size_t numStrips = (height + stripRows - 1) / stripRows;
+    std::vector<std::vector<uint8_t>> strips(numStrips);
+    std::vector<uLong> checksums(numStrips);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t s = 0; s < numStrips; ++s) {
+        size_t y0 = s * stripRows, y1 = std::min(height, y0 + stripRows);
+        std::vector<uint8_t> rows((width + 1) * (y1 - y0));
+        for (size_t y = y0, pos = 0; y < y1; ++y, pos += width + 1) {
+            rows[pos] = 0; // Filter type None
+            std::copy_n(&mask[y * width], width, &rows[pos + 1]);
+        }
+        checksums[s] = adler32(adler32(0, Z_NULL, 0), rows.data(), rows.size());
+        z_stream z = {};
+        deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        std::vector<uint8_t> & out = strips[s];
+        out.resize(deflateBound(&z, rows.size()) + 16);
+        z.next_in = rows.data();
+        z.avail_in = rows.size();
+        z.next_out = out.data();
+        z.avail_out = out.size();
+        deflate(&z, s == numStrips - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+        out.resize(z.total_out);
+        deflateEnd(&z);
+    }
+
+    uLong checksum = adler32(0, Z_NULL, 0);
+    for (size_t s = 0; s < numStrips && ok; ++s) {
+        size_t y0 = s * stripRows, y1 = std::min(height, y0 + stripRows);
+        checksum = adler32_combine(checksum, checksums[s], (width + 1) * (y1 - y0));
+        std::vector<uint8_t> data;
+        if (s == 0) {
+            data = { 0x78, 0x9c }; // zlib header, 32K window, default compression
+        }
+        data.insert(data.end(), strips[s].begin(), strips[s].end());
+        if (s == numStrips - 1) {
+            putUint32(data, checksum);
+        }
+        ok = writeChunk(file, "IDAT", data);
+    }
+    return ok && writeChunk(file, "IEND", std::vector<uint8_t>());
+}
+
+
+bool MaskFile::read(const QString & fileName, int numLayers, Array2D<uint8_t> & mask) {
+    Timer t("Read mask");
+    QImage image(fileName);
+    if (image.isNull()) {
+        return false;
+    }
+    image = image.convertToFormat(QImage::Format_Grayscale8);
+    // Rounds to the nearest layer, the inverse of the gray levels written by write
+    int numColors = numLayers - 1;
+    uint8_t layerOf[256];
+    for (int gray = 0; gray < 256; ++gray) {
+        layerOf[gray] = std::min(numColors, (gray * numColors + 128) / 256);
+    }
+    const int width = image.width(), height = image.height();
+    mask.resize(width, height);
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y) {
+        const uchar * src = image.constScanLine(y);
+        uint8_t * dst = &mask[y * width];
+        for (int x = 0; x < width; ++x) {
+            dst[x] = layerOf[src[x]];
+        }
+    }
+    return true;
+}
+
+} // namespace hdrmerge
@@ -0,0 +1,43 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _MASKFILE_HPP_
+#define _MASKFILE_HPP_
+
+#include <cstdint>
+#include <QString>
+#include "Array2D.hpp"
+
+namespace hdrmerge {
+
+/// Mask images, with layer i of n shown as gray 256 * i / (n - 1) and the last one as white
+class MaskFile {
+public:
+    /// Writes an indexed PNG, compressing strips of rows in parallel into a single deflate stream
+    static bool write(const QString & fileName, const Array2D<uint8_t> & mask, int numLayers);
+    /// Reads any gray or indexed image written as above, mapping its grays back to layers
+    static bool read(const QString & fileName, int numLayers, Array2D<uint8_t> & mask);
+};
+
+} // namespace hdrmerge
+
+#endif // _MASKFILE_HPP_
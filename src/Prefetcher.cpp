@@ -0,0 +1,75 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <memory>
+#include <QFile>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+#include "Prefetcher.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+void Prefetcher::prefetch(const std::vector<QString> & fileNames) {
+    cancel();
+    cancelled = false;
+    worker = std::thread(&Prefetcher::run, this, fileNames);
+}
+
+
+void Prefetcher::cancel() {
+    if (worker.joinable()) {
+        cancelled = true;
+        worker.join();
+    }
+}
+
+
+void Prefetcher::run(std::vector<QString> fileNames) {
+    Timer t("Prefetch");
+    const qint64 chunkSize = 1 << 20;
+    std::unique_ptr<char[]> buffer(new char[chunkSize]);
+    size_t left = budget;
+    for (const QString & name : fileNames) {
+        QFile file(name);
+        if (!file.open(QIODevice::ReadOnly)) continue;
+        qint64 size = std::min<qint64>(file.size(), left);
+#ifdef __linux__
+        // Let the kernel start its own read ahead of the whole range
+        posix_fadvise(file.handle(), 0, size, POSIX_FADV_WILLNEED);
+#endif
+        // Network file systems may ignore the advice, so the data is read anyway and thrown away
+        qint64 done = 0;
+        while (done < size && !cancelled) {
+            qint64 read = file.read(buffer.get(), std::min(chunkSize, size - done));
+            if (read <= 0) break;
+            done += read;
+        }
+        left -= done;
+        Log::debug("Prefetched ", done, " bytes of ", name);
+        if (cancelled || left == 0) break;
+    }
+}
+
+} // namespace hdrmerge
@@ -0,0 +1,56 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _PREFETCHER_HPP_
+#define _PREFETCHER_HPP_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <QString>
+
+namespace hdrmerge {
+
+/// Reads files ahead in a background thread, so that they are in the page cache when they are loaded.
+/// Each call to prefetch cancels the files not yet read by the previous one.
+class Prefetcher {
+public:
+    /// At most budget bytes are read ahead for each call to prefetch
+    Prefetcher(size_t budget) : budget(budget), cancelled(false) {}
+    ~Prefetcher() {
+        cancel();
+    }
+
+    void prefetch(const std::vector<QString> & fileNames);
+    void cancel();
+
+private:
+    size_t budget;
+    std::thread worker;
+    std::atomic<bool> cancelled;
+
+    void run(std::vector<QString> fileNames);
+};
+
+} // namespace hdrmerge
+
+#endif // _PREFETCHER_HPP_
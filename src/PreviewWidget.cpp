@@ -20,6 +20,8 @@
  *
  */
 
+#include <algorithm>
+#include <vector>
 #include "PreviewWidget.hpp"
 #include <QImage>
 #include <QPainter>
@@ -28,23 +30,93 @@
 #include <QApplication>
 #include <QBitmap>
 #include <QAction>
+#include <QTimer>
 #include "Log.hpp"
 
 namespace hdrmerge {
 
 PreviewWidget::PreviewWidget(ImageStack & s, QWidget * parent) : QWidget(parent), stack(s),
 width(0), height(0), flip(0), addPixels(false), rmPixels(false), layer(0), radius(5),
-mouseX(0), mouseY(0), expMult(1.0), cancelRender(false) {
+mouseX(0), mouseY(0), expMult(1.0), renderGeneration(0), renderSequence(0), tilesAcross(0),
+showBlended(false), featherRadius(3), blendGeneration(0) {
     float g = 1.0f / 2.2f;
     for (int i = 0; i < 65536; i++) {
         gamma[i] = (int)std::floor(65536.0f * std::pow(i / 65536.0f, g)) >> 8;
     }
     setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
     setMouseTracking(true);
+    // Brush edits are rendered at most once per frame, at 60Hz
+    flushTimer = new QTimer(this);
+    flushTimer->setSingleShot(true);
+    flushTimer->setInterval(16);
+    connect(flushTimer, SIGNAL(timeout()), this, SLOT(flushPendingZone()));
+    // The merged result is recomputed once edits settle
+    blendTimer = new QTimer(this);
+    blendTimer->setSingleShot(true);
+    blendTimer->setInterval(150);
+    connect(blendTimer, SIGNAL(timeout()), this, SLOT(composeBlended()));
+}
+
+
+void PreviewWidget::stopRender() {
+    flushTimer->stop();
+    pendingZone = QRect();
+    ++renderGeneration;
+    waitForRenders();
+    blendTimer->stop();
+    ++blendGeneration;
+    blendRender.waitForFinished();
+}
+
+
+void PreviewWidget::toggleBlended(bool toggled) {
+    // Renders keep their own view of the blended result, no need to wait for them
+    showBlended = toggled;
+    repaintAsync();
+    if (showBlended) {
+        composeBlended();
+    }
+}
+
+
+void PreviewWidget::setFeatherRadius(int r) {
+    featherRadius = r;
+    scheduleBlended();
+}
+
+
+void PreviewWidget::composeBlended() {
+    if (!showBlended || stack.size() == 0) return;
+    if (blendRender.isRunning()) {
+        // Try again when the current one finishes
+        blendTimer->start();
+        return;
+    }
+    unsigned int generation = ++blendGeneration;
+    int radius = featherRadius;
+    // The mask is taken here, the brush may edit it while the result is composed
+    auto smallMask = std::make_shared<Array2D<uint8_t>>(stack.previewMask(blendStep));
+    blendRender = QtConcurrent::run([this, generation, radius, smallMask] () {
+        auto result = std::make_shared<const Array2D<float>>(
+            stack.composePreview(outputParams, radius, blendStep, *smallMask));
+        if (generation != blendGeneration) return;
+        QMetaObject::invokeMethod(this, [this, generation, result] () {
+            installBlended(generation, result);
+        }, Qt::QueuedConnection);
+    });
+}
+
+
+void PreviewWidget::installBlended(unsigned int generation, std::shared_ptr<const Array2D<float>> result) {
+    if (generation != blendGeneration) return;
+    // Running renders keep the previous result until they stop
+    blended = result;
+    repaintAsync();
 }
 
 
 void PreviewWidget::reload() {
+    stopRender();
     layer = 0;
     expMult = 1.0;
     flip = stack.size() ? stack.getFlip() : 0;
@@ -55,16 +127,39 @@ void PreviewWidget::reload() {
         width = stack.getWidth();
         height = stack.getHeight();
     }
-    pixmap = QPixmap();
-    resize(QSize(0, 0));
+    // No render is running now, they all read the size and the tiles
+    tilesAcross = (width + tileSize - 1) / tileSize;
+    int tilesDown = (height + tileSize - 1) / tileSize;
+    tiles.clear();
+    tiles.resize(tilesAcross * tilesDown);
+    pendingZone = QRect();
+    blended.reset();
+    resize(QSize(width, height));
     repaintAsync();
+    scheduleBlended();
 }
 
 
 void PreviewWidget::repaintAsync() {
-    cancelRender = true;
-    currentRender.waitForFinished();
-    currentRender = QtConcurrent::run(&PreviewWidget::render, this, QRect(0, 0, width, height));
+    // Do not wait for the previous renders, they stop by themselves at the next tile
+    unsigned int generation = ++renderGeneration;
+    QRect visible(-pos(), parentWidget() ? parentWidget()->size() : size());
+    startRender(QtConcurrent::run(&PreviewWidget::renderProgressive, this, generation, ++renderSequence, visible,
+                                  renderState()));
+}
+
+
+void PreviewWidget::startRender(QFuture<void> future) {
+    renders.remove_if([] (const QFuture<void> & f) { return f.isFinished(); });
+    renders.push_back(future);
+}
+
+
+void PreviewWidget::waitForRenders() {
+    for (auto & f : renders) {
+        f.waitForFinished();
+    }
+    renders.clear();
 }
 
 
@@ -90,15 +185,30 @@ void PreviewWidget::rotate(int & x, int & y) const {
 
 
 QSize PreviewWidget::sizeHint() const {
-    return pixmap.size();
+    return QSize(width, height);
+}
+
+
+QRect PreviewWidget::tileRect(int tile) const {
+    QRect result((tile % tilesAcross) * tileSize, (tile / tilesAcross) * tileSize, tileSize, tileSize);
+    return result.intersected(QRect(0, 0, width, height));
 }
 
 
 void PreviewWidget::paintEvent(QPaintEvent * event) {
-    if (pixmap.isNull()) return;
+    QRect area = event->rect().intersected(QRect(0, 0, width, height));
+    if (tiles.empty() || area.isEmpty()) return;
 
     QPainter painter(this);
-    painter.drawPixmap(0, 0, pixmap);
+    for (int ty = area.top() / tileSize; ty <= area.bottom() / tileSize; ++ty) {
+        for (int tx = area.left() / tileSize; tx <= area.right() / tileSize; ++tx) {
+            const QImage & image = tiles[ty * tilesAcross + tx].image;
+            // RGB32 images are drawn as they are, without a conversion to a pixmap
+            if (!image.isNull()) {
+                painter.drawImage(tx * tileSize, ty * tileSize, image);
+            }
+        }
+    }
     if ((addPixels || rmPixels) && underMouse()) {
         painter.drawPixmap(mouseX - radius, mouseY - radius, brush);
     }
@@ -126,44 +236,137 @@ QRgb PreviewWidget::getColor(int layer, int v) {
 }
 
 
-QRgb PreviewWidget::rgb(int col, int row) const {
+QRgb PreviewWidget::rgb(int col, int row, const RenderState & state) const {
     rotate(col, row);
-    int v = (int)stack.value(col, row) * expMult;
+    if (state.blended && state.blended->size() > 0) {
+        int v = (*state.blended)(col / blendStep, row / blendStep) * state.expMult;
+        if (v < 0) v = 0;
+        else if (v > 65535) v = 65535;
+        return qRgb(gamma[v], gamma[v], gamma[v]);
+    }
+    int v = (int)stack.value(col, row) * state.expMult;
     if (v < 0) v = 0;
     else if (v > 65535) v = 65535;
     return getColor(stack.getImageAt(col, row), gamma[v]);
 }
 
 
-void PreviewWidget::render(QRect zone) {
-    if (!stack.size()) return;
-    zone = zone.intersected(QRect(0, 0, width, height));
-    if (zone.isNull()) return;
-    cancelRender = false;
+QImage PreviewWidget::renderZone(QRect zone, unsigned int generation, const RenderState & state) const {
     QImage image(zone.width(), zone.height(), QImage::Format_RGB32);
     #pragma omp parallel for schedule(dynamic)
     for (int row = zone.top(); row <= zone.bottom(); row++) {
         QRgb * scanLine = reinterpret_cast<QRgb *>(image.scanLine(row - zone.top()));
-        for (int col = zone.left(); !cancelRender && col <= zone.right(); col++) {
-            *scanLine++ = rgb(col, row);
+        for (int col = zone.left(); generation == renderGeneration && col <= zone.right(); col++) {
+            *scanLine++ = rgb(col, row, state);
         }
     }
-    if (!cancelRender) {
-        QMetaObject::invokeMethod(this, "paintImage", Qt::AutoConnection,
-                                Q_ARG(QPoint, zone.topLeft()), Q_ARG(const QImage &, image));
+    return image;
+}
+
+
+void PreviewWidget::render(QRect zone) {
+    if (tiles.empty()) return;
+    zone = zone.intersected(QRect(0, 0, width, height));
+    if (zone.isNull()) return;
+    // Tiles still queued by older renders must not overwrite the edited pixels
+    unsigned int sequence = ++renderSequence;
+    std::vector<int> edited;
+    for (int ty = zone.top() / tileSize; ty <= zone.bottom() / tileSize; ++ty) {
+        for (int tx = zone.left() / tileSize; tx <= zone.right() / tileSize; ++tx) {
+            int index = ty * tilesAcross + tx;
+            tiles[index].stamp = sequence;
+            edited.push_back(index);
+        }
     }
+    startRender(QtConcurrent::run(&PreviewWidget::renderTiles, this, renderGeneration.load(), sequence, edited,
+                                  renderState()));
 }
 
 
-void PreviewWidget::paintImage(QPoint where, const QImage & image) {
-    if (pixmap.isNull()) {
-        pixmap = QPixmap::fromImage(image);
-        resize(pixmap.size());
-    } else {
-        QPainter painter(&pixmap);
-        painter.drawImage(where, image);
+void PreviewWidget::renderTiles(unsigned int generation, unsigned int sequence, std::vector<int> edited,
+                                RenderState state) {
+    for (int tile : edited) {
+        QImage image = renderZone(tileRect(tile), generation, state);
+        if (generation != renderGeneration) return;
+        postTile(generation, sequence, tile, image);
     }
-    update(where.x(), where.y(), image.width(), image.height());
+}
+
+
+void PreviewWidget::flushPendingZone() {
+    QRect zone = pendingZone;
+    pendingZone = QRect();
+    render(zone);
+    scheduleBlended();
+    emit maskEdited();
+}
+
+
+void PreviewWidget::postTile(unsigned int generation, unsigned int sequence, int tile, const QImage & image) {
+    QMetaObject::invokeMethod(this, "paintTile", Qt::QueuedConnection,
+                              Q_ARG(unsigned int, generation), Q_ARG(unsigned int, sequence),
+                              Q_ARG(int, tile), Q_ARG(const QImage &, image));
+}
+
+
+void PreviewWidget::renderProgressive(unsigned int generation, unsigned int sequence, QRect visible,
+                                      RenderState state) {
+    if (tiles.empty()) return;
+
+    // Visible tiles go first, the rest by distance to the center of the viewport
+    std::vector<int> order(tiles.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    QPoint center = visible.center();
+    auto distance = [&] (int tile) {
+        QRect tr = tileRect(tile);
+        QPoint d = tr.center() - center;
+        return (tr.intersects(visible) ? 0 : 1ll << 62) + (long long)d.x()*d.x() + (long long)d.y()*d.y();
+    };
+    std::sort(order.begin(), order.end(), [&] (int a, int b) {
+        return distance(a) < distance(b);
+    });
+
+    // First, a coarse version of the whole image, one sample every coarseStep pixels
+    QImage coarse((width + coarseStep - 1) / coarseStep, (height + coarseStep - 1) / coarseStep, QImage::Format_RGB32);
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < coarse.height(); row++) {
+        QRgb * scanLine = reinterpret_cast<QRgb *>(coarse.scanLine(row));
+        int y = std::min(row * coarseStep + coarseStep / 2, (int)height - 1);
+        for (int col = 0; generation == renderGeneration && col < coarse.width(); col++) {
+            *scanLine++ = rgb(std::min(col * coarseStep + coarseStep / 2, (int)width - 1), y, state);
+        }
+    }
+    for (int tile : order) {
+        if (generation != renderGeneration) return;
+        QRect tr = tileRect(tile);
+        QImage image(tr.size(), QImage::Format_RGB32);
+        for (int row = 0; row < tr.height(); ++row) {
+            const QRgb * src = reinterpret_cast<const QRgb *>(coarse.constScanLine((tr.top() + row) / coarseStep));
+            QRgb * dst = reinterpret_cast<QRgb *>(image.scanLine(row));
+            for (int col = 0; col < tr.width(); ++col) {
+                dst[col] = src[(tr.left() + col) / coarseStep];
+            }
+        }
+        postTile(generation, sequence, tile, image);
+    }
+
+    // Then, refine it tile by tile
+    for (int tile : order) {
+        QImage image = renderZone(tileRect(tile), generation, state);
+        if (generation != renderGeneration) return;
+        postTile(generation, sequence, tile, image);
+    }
+}
+
+
+void PreviewWidget::paintTile(unsigned int generation, unsigned int sequence, int tile, const QImage & image) {
+    // Discard the results of a render that has been superseded, or of one older than the tile
+    if (generation != renderGeneration || tile >= (int)tiles.size() || sequence < tiles[tile].stamp) return;
+    tiles[tile].image = image;
+    tiles[tile].stamp = sequence;
+    update(tileRect(tile));
 }
 
 
@@ -196,21 +399,29 @@ void PreviewWidget::setShowBrush() {
 
 
 void PreviewWidget::mouseEvent(QMouseEvent * event, bool pressed) {
+    QRect oldBrush(mouseX - radius, mouseY - radius, 2*radius + 1, 2*radius + 1);
     int rx = mouseX = event->position().x(), ry = mouseY = event->position().y();
     rotate(rx, ry);
     if (rx >= 0 && rx < (int)stack.getWidth() && ry >= 0 && ry < (int)stack.getHeight())
         emit pixelUnderMouse(rx, ry);
     if ((event->buttons() & Qt::LeftButton) && (addPixels || rmPixels)) {
         event->accept();
-        if (pressed) {
-            stack.getMask().startAction(addPixels, layer);
+        if (pressed && !stack.getMask().startAction(addPixels, layer)) {
+            // There is no layer to move the pixels to, until the button is released
+            setCursor(QCursor(Qt::ForbiddenCursor));
+        }
+        QRect edited = stack.getMask().editPixels(rx, ry, radius);
+        if (!edited.isEmpty()) {
+            pendingZone |= QRect(unrotate(edited.topLeft()), unrotate(edited.bottomRight())).normalized();
+        }
+        if (!pendingZone.isEmpty() && !flushTimer->isActive()) {
+            flushTimer->start();
         }
-        stack.getMask().editPixels(rx, ry, radius);
-        render(QRect(mouseX - radius, mouseY - radius, 2*radius + 1, 2*radius + 1));
     } else {
         event->ignore();
     }
-    update();
+    update(oldBrush);
+    update(QRect(mouseX - radius, mouseY - radius, 2*radius + 1, 2*radius + 1));
 }
 
 
@@ -231,7 +442,9 @@ void PreviewWidget::wheelEvent(QWheelEvent * event) {
 void PreviewWidget::undo() {
     if (stack.getMask().canUndo()) {
         QRect undoRect = stack.getMask().undo();
-        render(QRect(unrotate(undoRect.topLeft()), unrotate(undoRect.bottomRight())));
+        render(QRect(unrotate(undoRect.topLeft()), unrotate(undoRect.bottomRight())).normalized());
+        scheduleBlended();
+        emit maskEdited();
     }
 }
 
@@ -239,7 +452,9 @@ void PreviewWidget::undo() {
 void PreviewWidget::redo() {
     if (stack.getMask().canRedo()) {
         QRect redoRect = stack.getMask().redo();
-        render(QRect(unrotate(redoRect.topLeft()), unrotate(redoRect.bottomRight())));
+        render(QRect(unrotate(redoRect.topLeft()), unrotate(redoRect.bottomRight())).normalized());
+        scheduleBlended();
+        emit maskEdited();
     }
 }
 
@@ -26,10 +26,14 @@
 #include <atomic>
 #include <memory>
 #include <list>
+#include <vector>
 #include <qwidget.h>
 #include <QPaintEvent>
 #include <QFuture>
+#include <QPixmap>
+#include <QTimer>
 #include "ImageStack.hpp"
+#include "RawParameters.hpp"
 
 namespace hdrmerge {
 
@@ -42,6 +46,11 @@ public:
 
     static QRgb getColor(int layer, int v);
 
+    void stopRender();
+    void setOutputParameters(const RawParameters & params) {
+        outputParams = params;
+    }
+
 public slots:
     void reload();
     void toggleAddPixelsTool(bool toggled) {
@@ -67,27 +76,44 @@ public slots:
     }
     void undo();
     void redo();
+    void toggleBlended(bool toggled);
+    void setFeatherRadius(int r);
 
 signals:
     void radiusChanged(int r);
     void pixelUnderMouse(int x, int y);
+    void maskEdited();
 
 protected:
     void paintEvent(QPaintEvent * event);
     void mousePressEvent(QMouseEvent * event) { mouseEvent(event, true); }
     void mouseMoveEvent(QMouseEvent * event) { mouseEvent(event, false); }
+    void mouseReleaseEvent(QMouseEvent * event) { setShowBrush(); event->ignore(); }
     void mouseEvent(QMouseEvent * event, bool pressed);
     void wheelEvent(QWheelEvent * event);
     void enterEvent(QEnterEvent * event) { update(); }
     void leaveEvent(QEvent * event) { update(); }
 
 private slots:
-    void paintImage(QPoint where, const QImage & image);
+    void paintTile(unsigned int generation, unsigned int sequence, int tile, const QImage & image);
+    void flushPendingZone();
+    void composeBlended();
 
 private:
     Q_OBJECT
 
-    QPixmap pixmap;
+    /// What a render shows, copied when it starts so that the GUI may change it meanwhile
+    struct RenderState {
+        double expMult;
+        std::shared_ptr<const Array2D<float>> blended; ///< Null if the layers are shown
+    };
+
+    struct Tile {
+        QImage image;       ///< Rendered out of the GUI thread
+        unsigned int stamp; ///< Sequence number of the render that produced image
+        Tile() : stamp(0) {}
+    };
+
     ImageStack & stack;
     size_t width, height;
     int flip;
@@ -97,12 +123,44 @@ private:
     int mouseX, mouseY;
     QPixmap brush;
     double expMult;
-    QFuture<void> currentRender;
-    std::atomic<bool> cancelRender;
+    std::list<QFuture<void>> renders; ///< Every render that may still be running
+    std::atomic<unsigned int> renderGeneration;
+    unsigned int renderSequence; ///< Increases with every render, older tiles never replace newer ones
+    std::vector<Tile> tiles;
+    int tilesAcross;
+    QRect pendingZone;
+    QTimer * flushTimer;
     uint8_t gamma[65536];
 
+    // Merged result, at a reduced resolution
+    bool showBlended;
+    int featherRadius;
+    RawParameters outputParams;
+    std::shared_ptr<const Array2D<float>> blended;
+    std::atomic<unsigned int> blendGeneration;
+    QFuture<void> blendRender;
+    QTimer * blendTimer;
+
+    static const int coarseStep = 8;
+    static const int tileSize = 256;
+    static const int blendStep = 2; ///< So that each sample covers a whole Bayer block
+
+    /// Renders again, out of the GUI thread, the tiles that intersect zone
     void render(QRect zone);
-    QRgb rgb(int col, int row) const;
+    void renderTiles(unsigned int generation, unsigned int sequence, std::vector<int> edited,
+                     RenderState state);
+    void renderProgressive(unsigned int generation, unsigned int sequence, QRect visible,
+                           RenderState state);
+    QImage renderZone(QRect zone, unsigned int generation, const RenderState & state) const;
+    RenderState renderState() const {
+        RenderState state;
+        state.expMult = expMult;
+        if (showBlended) state.blended = blended;
+        return state;
+    }
+    void postTile(unsigned int generation, unsigned int sequence, int tile, const QImage & image);
+    QRect tileRect(int tile) const;
+    QRgb rgb(int col, int row, const RenderState & state) const;
     void rotate(int & x, int & y) const;
     QPoint unrotate(QPoint p) const {
         int x = p.x(), y = p.y();
@@ -112,6 +170,13 @@ private:
     void createBrush(bool plus);
     void setShowBrush();
     void repaintAsync();
+    void startRender(QFuture<void> future);
+    /// Renders stop at the next tile once renderGeneration changes
+    void waitForRenders();
+    void installBlended(unsigned int generation, std::shared_ptr<const Array2D<float>> result);
+    void scheduleBlended() {
+        if (showBlended) blendTimer->start();
+    }
 };
 
 } // namespace hdrmerge
@@ -30,6 +30,13 @@ public:
     virtual void advance(int percent, const char * message, const char * arg = nullptr) = 0;
 };
 
+
+/// For the work done in the background, that nobody watches
+class NullProgressIndicator : public ProgressIndicator {
+public:
+    virtual void advance(int percent, const char * message, const char * arg) {}
+};
+
 } // namespace hdrmerge
 
 #endif // _PROGRESSINDICATOR_HPP
@@ -179,6 +179,24 @@ void RawParameters::calculateCamXyz() {
 }
 
 
+void RawParameters::setLevels(uint16_t white, int blackRows, int blackCols, const uint32_t * blackPattern) {
+    max = white;
+    // Unpacking moves the minimum of the pattern to the common black level, and fromLibRaw only
+    // reads back the pattern of a 2x2 one, and only its first value for X-Trans
+    uint32_t minb = *std::min_element(blackPattern, blackPattern + blackRows * blackCols);
+    black = 0;
+    std::fill_n(cblack, 4, minb);
+    if (FC.getFilters() == 9) {
+        std::fill_n(cblack, 4, blackPattern[0]);
+    } else if (blackRows * blackCols == 4) {
+        for (int c = 0; c < 4; c++) {
+            cblack[FC(c / 2, c % 2)] = blackPattern[c];
+        }
+    }
+    adjustBlack();
+}
+
+
 void RawParameters::fromLibRaw(LibRaw & rawData) {
     auto & r = rawData.imgdata;
     width = r.sizes.width;
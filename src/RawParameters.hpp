@@ -40,6 +40,9 @@ public:
     virtual ~RawParameters() {}
 
     void fromLibRaw(LibRaw & rawData);
+    /// Replaces the levels read by fromLibRaw before unpacking, with the white level and the
+    /// black level pattern of blackRows x blackCols (at most 2x2) of the file, as unpacking sets them
+    void setLevels(uint16_t white, int blackRows, int blackCols, const uint32_t * blackPattern);
 
     bool isSameFormat(const RawParameters & r) const {
         return width == r.width && height == r.height && FC == r.FC && cdesc == r.cdesc;
@@ -57,7 +60,6 @@ public:
     }
     void adjustWhite(const Array2D<uint16_t> & image);
     void autoWB(const Array2D<uint16_t> & image);
-    bool canAlign() const { return FC.canAlign(); }
 
     QString fileName;
     size_t width, height;
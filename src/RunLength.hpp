@@ -0,0 +1,73 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _RUNLENGTH_HPP_
+#define _RUNLENGTH_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace hdrmerge {
+
+/// Encodes a byte array as runs: the value, then the length minus one as a base-128 varint.
+inline std::vector<uint8_t> encodeRunLength(const uint8_t * src, size_t size) {
+    std::vector<uint8_t> result;
+    for (size_t i = 0; i < size;) {
+        uint8_t value = src[i];
+        size_t run = 1;
+        while (i + run < size && src[i + run] == value) ++run;
+        i += run;
+        result.push_back(value);
+        for (--run; run >= 128; run >>= 7) {
+            result.push_back((run & 127) | 128);
+        }
+        result.push_back(run);
+    }
+    return result;
+}
+
+
+/// Decodes exactly size bytes into dst, returns false if src is not a valid encoding of them.
+inline bool decodeRunLength(const uint8_t * src, size_t srcSize, uint8_t * dst, size_t size) {
+    size_t pos = 0, i = 0;
+    while (i < srcSize) {
+        uint8_t value = src[i++];
+        size_t run = 0;
+        int shift = 0;
+        while (i < srcSize && (src[i] & 128) && shift < 56) {
+            run |= (size_t)(src[i++] & 127) << shift;
+            shift += 7;
+        }
+        if (i >= srcSize) return false;
+        run |= (size_t)src[i++] << shift;
+        if (run >= size - pos) return false;
+        for (++run; run > 0; --run) {
+            dst[pos++] = value;
+        }
+    }
+    return pos == size;
+}
+
+} // namespace hdrmerge
+
+#endif // _RUNLENGTH_HPP_
@@ -0,0 +1,160 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+#include "SetQueue.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+/// Runs f with the lowest priority, so that the GUI and the current set go first
+template <typename Func> static auto lowPriority(Func f) -> decltype(f()) {
+    QThread * thread = QThread::currentThread();
+    QThread::Priority priority = thread->priority();
+    thread->setPriority(QThread::LowestPriority);
+    struct Restore {
+        QThread * thread;
+        QThread::Priority priority;
+        ~Restore() { thread->setPriority(priority); }
+    } restore{ thread, priority };
+    return f();
+}
+
+
+SetQueue::SetQueue(int maxResident, QObject * parent)
+    : QObject(parent), maxResident(std::max(maxResident, 1)), editorWaiting(false) {
+    // Each task already uses all the processors through OpenMP, a second one overlaps their I/O
+    pool.setMaxThreadCount(2);
+}
+
+
+SetQueue::~SetQueue() {
+    waitForAll();
+}
+
+
+void SetQueue::enqueue(const std::list<LoadOptions> & newSets) {
+    for (const LoadOptions & options : newSets) {
+        sets.emplace_back();
+        sets.back().options = options;
+        // Background sets are not shown until they are complete
+        sets.back().options.halfSizeFirst = false;
+    }
+    startLoads();
+}
+
+
+void SetQueue::requestNext() {
+    editorWaiting = true;
+    startLoads();
+}
+
+
+int SetQueue::takeNext(ImageIO & io, LoadOptions & options) {
+    Set & set = sets.front();
+    int result = set.load.result();
+    io.swap(*set.io);
+    options = set.options;
+    // The previous contents of io, if any, go away with the set
+    sets.pop_front();
+    editorWaiting = false;
+    startLoads();
+    return result;
+}
+
+
+void SetQueue::saveInBackground(ImageIO & io, const SaveOptions & options) {
+    saves.emplace_back();
+    Save & save = saves.back();
+    save.io = std::make_unique<ImageIO>();
+    save.io->swap(io);
+    // The compose cache and precomposed result of the editor come along, use them
+    save.io->enableSessionCache(true);
+    save.fileName = options.fileName;
+    ImageIO * saved = save.io.get();
+    save.future = QtConcurrent::run(&pool, [this, saved, options] () {
+        bool result = lowPriority([&] () {
+            NullProgressIndicator progress;
+            return saved->save(options, progress);
+        });
+        QMetaObject::invokeMethod(this, "taskFinished", Qt::QueuedConnection);
+        return result;
+    });
+}
+
+
+void SetQueue::waitForAll() {
+    for (Set & set : sets) {
+        set.load.waitForFinished();
+    }
+    for (Save & save : saves) {
+        save.future.waitForFinished();
+    }
+}
+
+
+void SetQueue::taskFinished() {
+    // Free the memory of the finished saves, so that more sets can be loaded
+    for (auto it = saves.begin(); it != saves.end(); ) {
+        if (it->future.isFinished()) {
+            if (!it->future.result()) {
+                emit saveFailed(it->fileName);
+            }
+            it = saves.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    startLoads();
+    emit changed();
+}
+
+
+void SetQueue::startLoads() {
+    int resident = saves.size() + (editorWaiting ? 0 : 1);
+    for (const Set & set : sets) {
+        if (set.io) ++resident;
+    }
+    for (Set & set : sets) {
+        if (resident >= maxResident) break;
+        if (set.io) continue;
+        set.io = std::make_unique<ImageIO>();
+        // Set up as the editor's, which it replaces
+        set.io->enableSessionCache(true);
+        ImageIO * loaded = set.io.get();
+        LoadOptions options = set.options;
+        Log::debug("Loading a set of ", options.fileNames.size(), " images in the background");
+        set.load = QtConcurrent::run(&pool, [this, loaded, options] () {
+            int result = lowPriority([&] () {
+                NullProgressIndicator progress;
+                return loaded->load(options, progress);
+            });
+            QMetaObject::invokeMethod(this, "taskFinished", Qt::QueuedConnection);
+            return result;
+        });
+        ++resident;
+    }
+}
+
+} // namespace hdrmerge
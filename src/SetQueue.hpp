@@ -0,0 +1,97 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SETQUEUE_HPP_
+#define _SETQUEUE_HPP_
+
+#include <list>
+#include <memory>
+#include <QFuture>
+#include <QObject>
+#include <QThreadPool>
+#include "ImageIO.hpp"
+
+namespace hdrmerge {
+
+/// Bracketed sets waiting to be edited in the GUI. The next ones are loaded in the background
+/// while the current one is edited, and saves run in the background too. At most maxResident
+/// sets are in memory, counting the one being edited, the ones loaded ahead and the ones saving.
+class SetQueue : public QObject {
+public:
+    SetQueue(int maxResident, QObject * parent = nullptr);
+    ~SetQueue();
+
+    void enqueue(const std::list<LoadOptions> & sets);
+    size_t pending() const {
+        return sets.size();
+    }
+    size_t saving() const {
+        return saves.size();
+    }
+    /// The editor is giving up its set, so the next one may take its room
+    void requestNext();
+    bool isNextReady() const {
+        return !sets.empty() && sets.front().io && sets.front().load.isFinished();
+    }
+    /// Moves the next set, which must be ready, into io. Returns the result of ImageIO::load,
+    /// and the options it was loaded with.
+    int takeNext(ImageIO & io, LoadOptions & options);
+    /// Takes the set loaded in io and saves it in the background, leaving io empty
+    void saveInBackground(ImageIO & io, const SaveOptions & options);
+    void waitForAll();
+
+signals:
+    /// A set finished loading or saving
+    void changed();
+    /// The background save of fileName did not write it
+    void saveFailed(const QString & fileName);
+
+private slots:
+    void taskFinished();
+
+private:
+    Q_OBJECT
+
+    struct Set {
+        LoadOptions options;
+        std::unique_ptr<ImageIO> io; ///< Null until its load starts
+        QFuture<int> load;
+    };
+    struct Save {
+        std::unique_ptr<ImageIO> io;
+        QString fileName;
+        QFuture<bool> future;
+    };
+
+    /// The loads and saves run here, and do not take the threads of the preview and precompose
+    QThreadPool pool;
+    std::list<Set> sets;
+    std::list<Save> saves;
+    int maxResident;
+    bool editorWaiting; ///< The editor holds no set while it waits for the next one
+
+    void startLoads();
+};
+
+} // namespace hdrmerge
+
+#endif // _SETQUEUE_HPP_
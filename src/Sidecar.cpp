@@ -0,0 +1,113 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include "Sidecar.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+QString Sidecar::fileNameFor(const QString & outputFileName) {
+    QString base = outputFileName;
+    if (base.endsWith(".dng", Qt::CaseInsensitive)) {
+        base.chop(4);
+    }
+    return base + ".hdrmerge";
+}
+
+
+static void writeHeader(QDataStream & out, const LoadOptions & options) {
+    out << (quint32)options.fileNames.size();
+    for (auto & name : options.fileNames) {
+        QFileInfo info(name);
+        out << info.absoluteFilePath() << (qint64)info.size() << (qint64)info.lastModified().toMSecsSinceEpoch();
+    }
+    if (!options.maskFileName.isEmpty()) {
+        QFileInfo info(options.maskFileName);
+        out << info.absoluteFilePath() << (qint64)info.size() << (qint64)info.lastModified().toMSecsSinceEpoch();
+    }
+    out << options.align << options.sampledAlign << options.crop << options.deghost << options.useCustomWl << options.customWl;
+}
+
+
+bool Sidecar::write(const QString & fileName, const LoadOptions & options, const ImageStack & stack) {
+    Timer t("Write sidecar");
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        Log::debug("Cannot write sidecar file ", fileName);
+        return false;
+    }
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_6_0);
+    out << magic << version;
+    writeHeader(out, options);
+    stack.writeAnalysis(out);
+    return out.status() == QDataStream::Ok;
+}
+
+
+bool Sidecar::read(const QString & fileName, const LoadOptions & options, ImageStack & stack) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    Timer t("Read sidecar");
+    QByteArray data = file.readAll();
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_6_0);
+    quint32 fileMagic, fileVersion;
+    in >> fileMagic >> fileVersion;
+    if (fileMagic != magic || fileVersion != version) {
+        Log::debug("Ignoring sidecar file ", fileName, " with unknown version");
+        return false;
+    }
+    // The header must match the current one byte by byte
+    QByteArray header;
+    {
+        QBuffer buffer(&header);
+        buffer.open(QIODevice::WriteOnly);
+        QDataStream headerOut(&buffer);
+        headerOut.setVersion(QDataStream::Qt_6_0);
+        writeHeader(headerOut, options);
+    }
+    qint64 headerPos = in.device()->pos();
+    if (data.mid(headerPos, header.size()) != header) {
+        Log::debug("Ignoring sidecar file ", fileName, ", the input files or options changed");
+        return false;
+    }
+    in.skipRawData(header.size());
+    qint64 analysisPos = in.device()->pos();
+    if (!stack.readAnalysis(in, false)) {
+        Log::debug("Ignoring invalid sidecar file ", fileName);
+        return false;
+    }
+    in.device()->seek(analysisPos);
+    in.resetStatus();
+    return stack.readAnalysis(in, true);
+}
+
+} // namespace hdrmerge
@@ -0,0 +1,47 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SIDECAR_HPP_
+#define _SIDECAR_HPP_
+
+#include <QString>
+#include "ImageStack.hpp"
+#include "LoadSaveOptions.hpp"
+
+namespace hdrmerge {
+
+/// The analysis of a stack, saved next to its output so that it can be loaded again without redoing it.
+/// It is only valid for the same input files, unmodified, and the same load options.
+class Sidecar {
+public:
+    static QString fileNameFor(const QString & outputFileName);
+    static bool write(const QString & fileName, const LoadOptions & options, const ImageStack & stack);
+    static bool read(const QString & fileName, const LoadOptions & options, ImageStack & stack);
+
+private:
+    static const quint32 magic = 0x48444d53; // "HDMS"
+    static const quint32 version = 2;
+};
+
+} // namespace hdrmerge
+
+#endif // _SIDECAR_HPP_
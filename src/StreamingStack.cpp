@@ -0,0 +1,177 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <QDataStream>
+#include "StreamingStack.hpp"
+#include "ImageStack.hpp"
+#include "Log.hpp"
+
+namespace hdrmerge {
+
+void StreamingStack::start(size_t frames, uint16_t saturationThreshold) {
+    numFrames = frames;
+    satThreshold = saturationThreshold;
+    previous = Image();
+    analysis.assign(frames, QByteArray());
+    offsets.assign(frames, QPoint());
+    exposures.assign(frames, 1.0);
+    mask.resize(0, 0);
+    cropOrigin = QPoint();
+    map.resize(0, 0);
+    composite.resize(0, 0);
+    nextFrame = 0;
+}
+
+
+void StreamingStack::analyze(size_t i, Image && frame, bool align, bool sampledAlign, const CFAPattern & FC) {
+    Timer t("Analyze frame");
+    frame.setSaturationThreshold(satThreshold);
+    if (i + 1 < numFrames) {
+        // The previous frame is the next darker one, already aligned and with its response function
+        if (align) {
+            frame.preScale(FC.getColumns(), FC.getRows());
+            size_t error = frame.alignWith(previous, sampledAlign);
+            frame.displace(previous.getDeltaX(), previous.getDeltaY());
+            Log::debug("Image ", i, " displaced to (", frame.getDeltaX(), ", ", frame.getDeltaY(), ") with error ", error);
+        }
+        frame.computeResponseFunction(previous);
+        previous.releaseAlignData();
+    } else {
+        if (align) {
+            frame.preScale(FC.getColumns(), FC.getRows());
+        }
+        mask.resize(frame.getWidth(), frame.getHeight());
+        std::fill_n(&mask[0], mask.size(), numFrames - 1);
+    }
+
+    // From the darkest to the brightest, the last frame that is not saturated wins
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < mask.getHeight(); ++y) {
+        for (size_t x = 0; x < mask.getWidth(); ++x) {
+            if (frame.contains(x, y) && !frame.isSaturatedAround(x, y)) {
+                mask(x, y) = i;
+            }
+        }
+    }
+
+    QDataStream out(&analysis[i], QIODevice::WriteOnly);
+    frame.writeAnalysis(out);
+    offsets[i] = QPoint(frame.getDeltaX(), frame.getDeltaY());
+    exposures[i] = frame.getRelativeExposure();
+    previous = std::move(frame);
+}
+
+
+void StreamingStack::finishAnalysis(bool crop) {
+    previous = Image();
+    if (!crop) return;
+    // As in ImageStack::crop
+    int dx = 0, dy = 0;
+    size_t width = mask.getWidth(), height = mask.getHeight();
+    size_t frameWidth = width, frameHeight = height;
+    for (const QPoint & offset : offsets) {
+        int newDx = std::max(dx, offset.x());
+        int bound = std::min(dx + width, offset.x() + frameWidth);
+        width = bound > newDx ? bound - newDx : 0;
+        dx = newDx;
+        int newDy = std::max(dy, offset.y());
+        bound = std::min(dy + height, offset.y() + frameHeight);
+        height = bound > newDy ? bound - newDy : 0;
+        dy = newDy;
+    }
+    Array2D<uint8_t> cropped(width, height);
+    for (size_t y = 0; y < height; ++y) {
+        std::copy_n(&mask(dx, dy + y), width, &cropped(0, y));
+    }
+    mask = std::move(cropped);
+    cropOrigin = QPoint(dx, dy);
+}
+
+
+void StreamingStack::beginCompose(const RawParameters & p, int featherRadius) {
+    params = p;
+    map = ImageStack::featherMask(mask, featherRadius);
+    composite.resize(mask.getWidth(), mask.getHeight());
+    nextFrame = 0;
+}
+
+
+void StreamingStack::compose(Image && frame) {
+    Timer t("Blend frame");
+    size_t i = nextFrame++;
+    frame.setSaturationThreshold(satThreshold);
+    QDataStream in(analysis[i]);
+    if (!frame.readAnalysis(in, true)) {
+        Log::debug("Frame ", i, " differs from the first pass");
+    }
+    frame.displace(-cropOrigin.x(), -cropOrigin.y());
+    if (i > 0) {
+        blendLayer(i - 1, previous, &frame);
+    }
+    if (i + 1 == numFrames) {
+        blendLayer(i, frame, nullptr);
+        previous = Image();
+    } else {
+        previous = std::move(frame);
+    }
+}
+
+
+void StreamingStack::blendLayer(int layer, const Image & image, const Image * next) {
+    #pragma omp parallel for schedule(dynamic,16)
+    for (size_t y = 0; y < composite.getHeight(); ++y) {
+        for (size_t x = 0; x < composite.getWidth(); ++x) {
+            double p = std::max(map(x, y), 0.0f);
+            if ((int)p == layer) {
+                composite(x, y) = ImageStack::blend(params, image, next, mask(x, y), satThreshold, x, y, p);
+            }
+        }
+    }
+}
+
+
+Array2D<float> StreamingStack::finishCompose() {
+    float max = 0.0;
+    #pragma omp parallel
+    {
+        float maxthr = 0.0;
+        #pragma omp for schedule(dynamic,16) nowait
+        for (size_t y = 0; y < composite.getHeight(); ++y) {
+            for (size_t x = 0; x < composite.getWidth(); ++x) {
+                if (composite(x, y) > maxthr) {
+                    maxthr = composite(x, y);
+                }
+            }
+        }
+        #pragma omp critical
+        if (maxthr > max) {
+            max = maxthr;
+        }
+    }
+    Array2D<float> result = ImageStack::scaleToRaw(composite, max, params);
+    map.resize(0, 0);
+    composite.resize(0, 0);
+    return result;
+}
+
+} // namespace hdrmerge
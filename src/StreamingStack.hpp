@@ -0,0 +1,86 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _STREAMINGSTACK_HPP_
+#define _STREAMINGSTACK_HPP_
+
+#include <vector>
+#include <QByteArray>
+#include <QPoint>
+#include "Image.hpp"
+#include "Array2D.hpp"
+#include "RawParameters.hpp"
+
+namespace hdrmerge {
+
+/// Merges a stack keeping at most two frames in memory. The frames are given twice. First from
+/// the darkest to the brightest, to align them, fit their response functions and build the mask.
+/// Then from the brightest to the darkest, to blend each pair of neighbouring layers.
+/// Only the automatic mask is supported.
+class StreamingStack {
+public:
+    StreamingStack() : numFrames(0), satThreshold(0), nextFrame(0) {}
+
+    void start(size_t frames, uint16_t saturationThreshold);
+    size_t size() const {
+        return numFrames;
+    }
+    /// First pass, frame i from numFrames - 1 down to 0
+    void analyze(size_t i, Image && frame, bool align, bool sampledAlign, const CFAPattern & FC);
+    /// Ends the first pass, optionally cropping to the area covered by every frame
+    void finishAnalysis(bool crop);
+
+    /// Second pass, frames from 0 to numFrames - 1
+    void beginCompose(const RawParameters & params, int featherRadius);
+    void compose(Image && frame);
+    Array2D<float> finishCompose();
+
+    size_t getWidth() const {
+        return mask.getWidth();
+    }
+    size_t getHeight() const {
+        return mask.getHeight();
+    }
+    double getMaxExposure() const {
+        return exposures.back() / exposures.front();
+    }
+
+private:
+    size_t numFrames;
+    uint16_t satThreshold;
+    Image previous;
+    std::vector<QByteArray> analysis; ///< Displacement and response function of each frame
+    std::vector<QPoint> offsets;
+    std::vector<double> exposures;
+    Array2D<uint8_t> mask;
+    QPoint cropOrigin;
+    RawParameters params;
+    Array2D<float> map;
+    Array2D<float> composite;
+    size_t nextFrame;
+
+    void blendLayer(int layer, const Image & image, const Image * next);
+};
+
+} // namespace hdrmerge
+
+#endif // _STREAMINGSTACK_HPP_
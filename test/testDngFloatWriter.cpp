@@ -33,7 +33,7 @@ using namespace std;
 
 BOOST_AUTO_TEST_CASE(testDngFloatWriter) {
     RawParameters params("test/sample1.dng");
-    Image image = ImageIO::loadRawImage(params);
+    Image image = ImageIO::loadRawImage(params.fileName, params);
     int imageWidth = image.getWidth();
     float max = 0;
     for (auto i : image) {
@@ -0,0 +1,78 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <vector>
+#include <libraw.h>
+#include "../src/DngReader.hpp"
+#include "../src/RawParameters.hpp"
+#include <boost/test/unit_test.hpp>
+using namespace hdrmerge;
+using namespace std;
+
+
+BOOST_AUTO_TEST_CASE(testDngReaderMatchesLibRaw) {
+    for (const char * fileName : { "test/sample1.dng", "test/sample2.dng", "test/sample3.dng" }) {
+        LibRaw rawProcessor;
+        BOOST_REQUIRE_EQUAL(rawProcessor.open_file(fileName), LIBRAW_SUCCESS);
+        BOOST_REQUIRE_EQUAL(rawProcessor.unpack(), LIBRAW_SUCCESS);
+        auto & s = rawProcessor.imgdata.sizes;
+        vector<uint16_t> raw(s.raw_width * s.raw_height);
+        BOOST_REQUIRE(DngReader::decode(fileName, s.raw_width, s.raw_height, raw.data()));
+        BOOST_CHECK(std::equal(raw.begin(), raw.end(), rawProcessor.imgdata.rawdata.raw_image));
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(testDngReaderLevelsMatchLibRaw) {
+    for (const char * fileName : { "test/sample1.dng", "test/sample2.dng", "test/sample3.dng" }) {
+        // The parameters of the native path are read before unpacking
+        LibRaw opened;
+        BOOST_REQUIRE_EQUAL(opened.open_file(fileName), LIBRAW_SUCCESS);
+        auto & s = opened.imgdata.sizes;
+        vector<uint16_t> raw(s.raw_width * s.raw_height);
+        DngReader::Levels levels;
+        BOOST_REQUIRE(DngReader::decode(fileName, s.raw_width, s.raw_height, raw.data(), &levels));
+        RawParameters native(fileName);
+        native.fromLibRaw(opened);
+        native.setLevels(levels.white, levels.blackRows, levels.blackCols, levels.black);
+
+        LibRaw unpacked;
+        BOOST_REQUIRE_EQUAL(unpacked.open_file(fileName), LIBRAW_SUCCESS);
+        BOOST_REQUIRE_EQUAL(unpacked.unpack(), LIBRAW_SUCCESS);
+        RawParameters libRaw(fileName);
+        libRaw.fromLibRaw(unpacked);
+
+        BOOST_CHECK_EQUAL(native.max, libRaw.max);
+        BOOST_CHECK_EQUAL(native.black, libRaw.black);
+        BOOST_CHECK_EQUAL(native.maxBlack, libRaw.maxBlack);
+        for (int c = 0; c < 4; ++c) {
+            BOOST_CHECK_EQUAL(native.cblack[c], libRaw.cblack[c]);
+        }
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(testDngReaderRejectsWrongSize) {
+    vector<uint16_t> raw(100 * 100);
+    BOOST_CHECK(!DngReader::decode("test/sample1.dng", 100, 100, raw.data()));
+    BOOST_CHECK(!DngReader::decode("test/sample1.png", 100, 100, raw.data()));
+}
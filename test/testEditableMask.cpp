@@ -0,0 +1,154 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "../src/EditableMask.hpp"
+#include <boost/test/unit_test.hpp>
+using namespace hdrmerge;
+using namespace std;
+
+
+class TestMask : public EditableMask {
+public:
+    TestMask(size_t w, size_t h) {
+        resize(w, h);
+    }
+    QRect valid[2];
+private:
+    virtual QRect layerRect(int layer) const {
+        return layer >= 0 && layer < 2 ? valid[layer] : QRect();
+    }
+};
+
+
+static int countLayer(const TestMask & m, int layer) {
+    int result = 0;
+    for (size_t i = 0; i < m.size(); ++i) {
+        if (m[i] == layer) ++result;
+    }
+    return result;
+}
+
+
+BOOST_AUTO_TEST_CASE(editablemask_circle) {
+    TestMask m(32, 32);
+    m.valid[0] = m.valid[1] = QRect(0, 0, 32, 32);
+    m.startAction(false, 0);
+    QRect edited = m.editPixels(16, 16, 3);
+    BOOST_CHECK(edited == QRect(13, 13, 7, 7));
+    int count = 0;
+    for (int y = -3; y <= 3; ++y)
+        for (int x = -3; x <= 3; ++x)
+            if (x*x + y*y <= 9) ++count;
+    BOOST_CHECK_EQUAL(countLayer(m, 1), count);
+    BOOST_CHECK_EQUAL(m(16, 16), 1);
+    BOOST_CHECK_EQUAL(m(13, 13), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(editablemask_capsule) {
+    TestMask m(64, 32);
+    m.valid[0] = m.valid[1] = QRect(0, 0, 64, 32);
+    m.startAction(false, 0);
+    m.editPixels(10, 16, 2);
+    // A fast stroke leaves no gaps between events, only new pixels are reported
+    QRect edited = m.editPixels(50, 16, 2);
+    BOOST_CHECK(edited == QRect(11, 14, 42, 5));
+    for (int x = 10; x <= 50; ++x) {
+        BOOST_CHECK_EQUAL(m(x, 14), 1);
+        BOOST_CHECK_EQUAL(m(x, 18), 1);
+    }
+    BOOST_CHECK_EQUAL(m(30, 13), 0);
+    BOOST_CHECK_EQUAL(m(30, 19), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(editablemask_validity) {
+    TestMask m(32, 32);
+    m.valid[0] = QRect(0, 0, 32, 32);
+    m.valid[1] = QRect(4, 4, 20, 20);
+    m.startAction(false, 0);
+    m.editPixels(4, 4, 3);
+    BOOST_CHECK_EQUAL(m(3, 4), 0);
+    BOOST_CHECK_EQUAL(m(4, 3), 0);
+    BOOST_CHECK_EQUAL(m(4, 4), 1);
+    BOOST_CHECK_EQUAL(m(7, 4), 1);
+    // There is no layer after the last one to move its pixels to
+    BOOST_CHECK(!m.startAction(false, 1));
+    BOOST_CHECK(m.editPixels(4, 4, 3).isEmpty());
+    BOOST_CHECK_EQUAL(m(4, 4), 1);
+    // Nor a layer before the first one
+    BOOST_CHECK(!m.startAction(true, -1));
+    // The refused actions are not undone
+    m.undo();
+    BOOST_CHECK_EQUAL(m(4, 4), 0);
+    BOOST_CHECK(!m.canUndo());
+}
+
+
+BOOST_AUTO_TEST_CASE(editablemask_undo_redo) {
+    TestMask m(32, 32);
+    m.valid[0] = m.valid[1] = QRect(0, 0, 32, 32);
+    m.startAction(false, 0);
+    m.editPixels(8, 8, 4);
+    m.editPixels(20, 20, 4);
+    int painted = countLayer(m, 1);
+    m.startAction(true, 0);
+    m.editPixels(14, 14, 2);
+    int repainted = countLayer(m, 1);
+    BOOST_CHECK(repainted < painted);
+
+    BOOST_CHECK(m.canUndo());
+    m.undo();
+    BOOST_CHECK_EQUAL(countLayer(m, 1), painted);
+    QRect area = m.undo();
+    BOOST_CHECK_EQUAL(countLayer(m, 1), 0);
+    BOOST_CHECK(area == QRect(4, 4, 21, 21));
+    BOOST_CHECK(!m.canUndo());
+    m.redo();
+    m.redo();
+    BOOST_CHECK_EQUAL(countLayer(m, 1), repainted);
+    BOOST_CHECK(!m.canRedo());
+}
+
+
+BOOST_AUTO_TEST_CASE(editablemask_replay) {
+    TestMask half(16, 16);
+    half.valid[0] = half.valid[1] = QRect(0, 0, 16, 16);
+    half.startAction(false, 0);
+    half.editPixels(5, 5, 1);
+    half.startAction(false, 0);
+    half.editPixels(12, 12, 1);
+    half.undo();
+
+    TestMask full(32, 32);
+    full.valid[0] = full.valid[1] = QRect(0, 0, 32, 32);
+    full.replay(half, 2, 1, 0);
+    // Only the first action was applied, each pixel becomes a 2x2 block
+    BOOST_CHECK_EQUAL(countLayer(full, 1), countLayer(half, 1) * 4);
+    BOOST_CHECK_EQUAL(full(11, 10), 1);
+    BOOST_CHECK_EQUAL(full(12, 11), 1);
+    BOOST_CHECK_EQUAL(full(9, 9), 0);
+    BOOST_CHECK(full.canUndo());
+    BOOST_CHECK(!full.canRedo());
+    full.undo();
+    BOOST_CHECK_EQUAL(countLayer(full, 1), 0);
+}
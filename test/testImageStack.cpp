@@ -48,12 +48,12 @@ struct ImageIOFixture {
 
 BOOST_FIXTURE_TEST_CASE(image_load, ImageIOFixture) {
     RawParameters m1(image1), m2(image2), m3(sample1);
-    e1 = io.loadRawImage(m1);
+    e1 = ImageIO::loadRawImage(m1.fileName, m1);
     BOOST_REQUIRE(e1.good());
-    e2 = io.loadRawImage(m2);
+    e2 = ImageIO::loadRawImage(m2.fileName, m2);
     BOOST_REQUIRE(e2.good());
     BOOST_REQUIRE(m2.isSameFormat(m1));
-    e3 = io.loadRawImage(m3);
+    e3 = ImageIO::loadRawImage(m3.fileName, m3);
     BOOST_CHECK(!e3.good());
 }
 
@@ -63,10 +63,10 @@ BOOST_FIXTURE_TEST_CASE(image_align, ImageIOFixture) {
     SampleImage si2(sample2);
     SampleImage si3(sample3);
     SampleImage si4(sample4);
-    e1 = Image(si1.begin(), si1.params);
-    e2 = Image(si2.begin(), si2.params);
-    e3 = Image(si3.begin(), si3.params);
-    e4 = Image(si4.begin(), si4.params);
+    e1 = Image(si1.begin(), si1.params, sample1);
+    e2 = Image(si2.begin(), si2.params, sample2);
+    e3 = Image(si3.begin(), si3.params, sample3);
+    e4 = Image(si4.begin(), si4.params, sample4);
     BOOST_REQUIRE(e1.good());
     BOOST_REQUIRE(e2.good());
     BOOST_REQUIRE(e3.good());
@@ -97,11 +97,33 @@ BOOST_FIXTURE_TEST_CASE(image_align, ImageIOFixture) {
     BOOST_CHECK_EQUAL(e4.getDeltaY(), -4);
 }
 
+
+BOOST_AUTO_TEST_CASE(image_align_sampled) {
+    const char * samples[] = { sample1, sample2, sample3, sample4 };
+    SampleImage si[4];
+    Image dense[4], sampled[4];
+    for (int i = 0; i < 4; ++i) {
+        si[i] = SampleImage(samples[i]);
+        dense[i] = Image(si[i].begin(), si[i].params, samples[i]);
+        sampled[i] = Image(si[i].begin(), si[i].params, samples[i]);
+        BOOST_REQUIRE(dense[i].good());
+        dense[i].preScale(); dense[i].setSaturationThreshold(254);
+        sampled[i].preScale(); sampled[i].setSaturationThreshold(254);
+    }
+    for (int i = 1; i < 4; ++i) {
+        dense[i].alignWith(dense[0]);
+        sampled[i].alignWith(sampled[0], true);
+        BOOST_CHECK_EQUAL(sampled[i].getDeltaX(), dense[i].getDeltaX());
+        BOOST_CHECK_EQUAL(sampled[i].getDeltaY(), dense[i].getDeltaY());
+    }
+}
+
+
 BOOST_AUTO_TEST_CASE(stack_load) {
     ImageStack images;
     BOOST_CHECK_EQUAL(images.size(), 0);
     RawParameters m1(image2), m2(image1);
-    Image e1(ImageIO::loadRawImage(m1)), e2(ImageIO::loadRawImage(m2));
+    Image e1(ImageIO::loadRawImage(m1.fileName, m1)), e2(ImageIO::loadRawImage(m2.fileName, m2));
     BOOST_REQUIRE(e1.good());
     BOOST_REQUIRE(e2.good());
     images.addImage(std::move(e1));
@@ -117,10 +139,10 @@ BOOST_AUTO_TEST_CASE(stack_align) {
     SampleImage si2(sample2);
     SampleImage si3(sample3);
     SampleImage si4(sample4);
-    Image e1(si1.begin(), si1.params),
-        e2(si2.begin(), si2.params),
-        e3(si3.begin(), si3.params),
-        e4(si4.begin(), si4.params);
+    Image e1(si1.begin(), si1.params, sample1),
+        e2(si2.begin(), si2.params, sample2),
+        e3(si3.begin(), si3.params, sample3),
+        e4(si4.begin(), si4.params, sample4);
     BOOST_REQUIRE(e1.good());
     BOOST_REQUIRE(e2.good());
     BOOST_REQUIRE(e3.good());
@@ -156,9 +178,9 @@ BOOST_AUTO_TEST_CASE(auto_exposure) {
     Image e1, e2, e3;
     RawParameters m1(image1), m2(image2), m3(image3);
     measureTime("Load images", [&] () {
-        e1 = ImageIO::loadRawImage(m1);
-        e2 = ImageIO::loadRawImage(m2);
-        e3 = ImageIO::loadRawImage(m3);
+        e1 = ImageIO::loadRawImage(m1.fileName, m1);
+        e2 = ImageIO::loadRawImage(m2.fileName, m2);
+        e3 = ImageIO::loadRawImage(m3.fileName, m3);
     });
     BOOST_REQUIRE(e1.good());
     BOOST_REQUIRE(e2.good());
@@ -184,11 +206,6 @@ BOOST_AUTO_TEST_CASE(auto_exposure) {
 }
 
 
-struct NullProgressIndicator : public ProgressIndicator {
-    virtual void advance(int percent, const char * message, const char * arg) {}
-};
-
-
 BOOST_AUTO_TEST_CASE(output_filename) {
     ImageIO io;
     LoadOptions lo;
@@ -205,3 +222,85 @@ BOOST_AUTO_TEST_CASE(output_filename) {
     string threeFile = io.buildOutputFileName().toLocal8Bit().constData();
     BOOST_CHECK_EQUAL(threeFile, pwd + "/test/sample1-3.dng");
 }
+
+
+BOOST_AUTO_TEST_CASE(compose_stats) {
+    ImageStack::ComposeStats a, b;
+    a.layerPixels = { 6, 2 };
+    b.layerPixels = { 1, 3 };
+    a.clippedPixels = 1;
+    b.adjustedPixels = 2;
+    a.minValue = 0.5f;
+    b.minValue = 0.25f;
+    a.maxValue = 2.0f;
+    b.maxValue = 4.0f;
+    a.add(b);
+    BOOST_CHECK_EQUAL(a.layerPixels[0], 7);
+    BOOST_CHECK_EQUAL(a.layerPixels[1], 5);
+    BOOST_CHECK_EQUAL(a.clippedPixels, 1);
+    BOOST_CHECK_EQUAL(a.adjustedPixels, 2);
+    BOOST_CHECK_CLOSE(a.dynamicRange(), 4.0, 1e-6);
+    BOOST_CHECK_EQUAL(ImageStack::ComposeStats().dynamicRange(), 0.0);
+}
+
+
+BOOST_AUTO_TEST_CASE(compose_stats_of_stack) {
+    ImageIO io;
+    LoadOptions lo;
+    lo.useSidecar = false;
+    NullProgressIndicator npi;
+    lo.fileNames.push_back(image1);
+    lo.fileNames.push_back(image2);
+    lo.fileNames.push_back(image3);
+    BOOST_REQUIRE_EQUAL(io.load(lo, npi), 6);
+    const ImageStack & stack = io.getImageStack();
+    for (int radius : { 0, 3 }) {
+        ImageStack::ComposeStats stats;
+        stack.compose(io.getOutputParameters(), radius, &stats);
+        BOOST_REQUIRE_EQUAL(stats.layerPixels.size(), stack.size());
+        size_t layerPixels = 0;
+        for (size_t n : stats.layerPixels) {
+            layerPixels += n;
+        }
+        BOOST_CHECK_EQUAL(stats.pixels, stack.getWidth() * stack.getHeight());
+        BOOST_CHECK_EQUAL(layerPixels, stats.pixels);
+        // The mask has not been edited, nothing is adjusted
+        BOOST_CHECK_EQUAL(stats.adjustedPixels, 0);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(compose_cache_stats) {
+    ImageIO io;
+    LoadOptions lo;
+    lo.useSidecar = false;
+    NullProgressIndicator npi;
+    lo.fileNames.push_back(image1);
+    lo.fileNames.push_back(image2);
+    lo.fileNames.push_back(image3);
+    BOOST_REQUIRE_EQUAL(io.load(lo, npi), 6);
+    ImageStack & stack = io.getImageStack();
+    const RawParameters & params = io.getOutputParameters();
+    ImageStack::ComposeCache cache;
+    stack.compose(params, 3, cache, QRect());
+    // Nothing to recompute, the statistics are kept
+    stack.compose(params, 3, cache, QRect());
+    BOOST_CHECK(cache.updated.isEmpty());
+    stack.getMask().startAction(true, 0);
+    stack.getMask().editPixels(1000, 1000, 200);
+    stack.getMask().editPixels(1500, 1200, 200);
+    QRect dirty = stack.getMask().getDirtyArea();
+    BOOST_REQUIRE(!dirty.isEmpty());
+    stack.compose(params, 3, cache, dirty);
+    BOOST_CHECK(cache.updated.contains(dirty));
+    BOOST_CHECK(cache.updated != QRect(0, 0, stack.getWidth(), stack.getHeight()));
+    ImageStack::ComposeStats stats;
+    stack.compose(params, 3, &stats);
+    BOOST_CHECK(cache.stats.layerPixels == stats.layerPixels);
+    BOOST_CHECK_EQUAL(cache.stats.pixels, stats.pixels);
+    BOOST_CHECK_EQUAL(cache.stats.clippedPixels, stats.clippedPixels);
+    BOOST_CHECK_EQUAL(cache.stats.adjustedPixels, stats.adjustedPixels);
+    BOOST_CHECK_GT(cache.stats.adjustedPixels, 0);
+    // The blur of the dirty area rounds a little differently than that of the whole mask
+    BOOST_CHECK_CLOSE(cache.max, stats.maxValue, 1e-3);
+}
@@ -0,0 +1,64 @@
+/*
+ *  HDRMerge - HDR exposure merging software.
+ *  Copyright 2012 Javier Celaya
+ *  jcelaya@gmail.com
+ *
+ *  This file is part of HDRMerge.
+ *
+ *  HDRMerge is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  HDRMerge is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with HDRMerge. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "../src/RunLength.hpp"
+#include <boost/test/unit_test.hpp>
+using namespace hdrmerge;
+using namespace std;
+
+
+BOOST_AUTO_TEST_CASE(runlength_roundtrip) {
+    vector<uint8_t> data(100000, 0);
+    fill_n(data.begin() + 10, 200, 3);
+    fill_n(data.begin() + 50000, 20000, 1);
+    data[99999] = 2;
+    vector<uint8_t> encoded = encodeRunLength(data.data(), data.size());
+    BOOST_CHECK(encoded.size() < 20);
+    vector<uint8_t> decoded(data.size());
+    BOOST_CHECK(decodeRunLength(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    BOOST_CHECK(decoded == data);
+}
+
+
+BOOST_AUTO_TEST_CASE(runlength_varied) {
+    vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (i * 7919) % 5;
+    }
+    vector<uint8_t> encoded = encodeRunLength(data.data(), data.size());
+    vector<uint8_t> decoded(data.size());
+    BOOST_CHECK(decodeRunLength(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    BOOST_CHECK(decoded == data);
+}
+
+
+BOOST_AUTO_TEST_CASE(runlength_invalid) {
+    vector<uint8_t> data(300, 4);
+    vector<uint8_t> encoded = encodeRunLength(data.data(), data.size());
+    vector<uint8_t> decoded(299);
+    BOOST_CHECK(!decodeRunLength(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    decoded.resize(301);
+    BOOST_CHECK(!decodeRunLength(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    encoded.pop_back();
+    decoded.resize(300);
+    BOOST_CHECK(!decodeRunLength(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+}